@@ -0,0 +1,51 @@
+# Write a synthetic "black MIDI" file for benchmarking miditones: ntracks tracks on
+# 16 channels, each with nnotes short random notes packed close together.
+# The random numbers are seeded, so the same arguments always make the same file.
+#
+#   python3 blackmidi.py ntracks nnotes file.mid
+#
+# "make bench" uses it; see the Makefile.
+
+import random
+import struct
+import sys
+
+def varlen(n):  # a MIDI variable-length number
+    b = [n & 0x7f]
+    n >>= 7
+    while n:
+        b.append((n & 0x7f) | 0x80)
+        n >>= 7
+    return bytes(reversed(b))
+
+def track(events):  # events are (tick, bytes), in any order
+    events.sort(key=lambda e: e[0])
+    out = bytearray()
+    last = 0
+    for tick, event in events:
+        out += varlen(tick - last) + event
+        last = tick
+    out += varlen(0) + b'\xff\x2f\x00'  # end of track
+    return b'MTrk' + struct.pack('>I', len(out)) + bytes(out)
+
+def main():
+    if len(sys.argv) != 4:
+        sys.exit("use: python3 blackmidi.py ntracks nnotes file.mid")
+    ntracks, nnotes, name = int(sys.argv[1]), int(sys.argv[2]), sys.argv[3]
+    r = random.Random(11)
+    tracks = [track([(0, b'\xff\x51\x03\x07\xa1\x20')])]  # tempo 500000 usec/beat
+    for k in range(ntracks):
+        ch = k % 16
+        events = [(0, bytes([0xc0 | ch, k % 128]))]  # an instrument for the track
+        tick = 0
+        for i in range(nnotes):
+            tick += r.choice([0, 0, 10, 20, 40])
+            note = r.randrange(24, 108)
+            length = r.choice([5, 10, 20, 60])
+            events.append((tick, bytes([0x90 | ch, note, r.randrange(1, 127)])))
+            events.append((tick + length, bytes([0x80 | ch, note, 0])))
+        tracks.append(track(events))
+    with open(name, 'wb') as f:
+        f.write(b'MThd' + struct.pack('>IHHH', 6, 1, len(tracks), 480) + b''.join(tracks))
+
+main()
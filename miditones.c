@@ -139,6 +139,10 @@
   -c=n  Only process the channel numbers whose bits are on in the number "n".
         For example, -c3 means "only process channels 0 and 1". In addition to
         decimal, "n" can be also specified in hex using a 0x prefix.
+        Files that use the MIDI port meta-event for more than 16 channels number
+        the channels of port p from 16*p, so up to 64 bits can be given for four
+        ports, e.g. -c=0xffff0000 for only port 1. Channels of ports beyond that
+        are only processed if no mask is given.
 
   -dp   Generate Arduino IDE-dependent C code that uses PROGMEM for the bytestream.
 
@@ -202,6 +206,200 @@
                    <basefilenam>.c. That allows multiple scores to be directly #included
                    into an Arduino .ino file without modification.
 
+  -maxinstruments=k Don't let more than k different instruments sound at the same time, for
+                   players like Playtune_samp that only have room for a few instrument samples.
+                   A note that would exceed the limit is changed to a sounding instrument of
+                   the same General MIDI family (for example, one piano for another) if there
+                   is one, or is otherwise skipped. Translated percussion notes are not counted.
+
+  -percussiongens=n Reserve the last n tone generators for translated percussion notes, so
+                   that drums and melody don't compete for the same generators. (Only valid
+                   with -pt.)
+
+  -percussionmax=x Stop each translated percussion note at most x milliseconds after it
+                   starts: at its "note off" if that comes sooner, and otherwise after x
+                   milliseconds. Drum notes often have long or missing "note off" events,
+                   and would otherwise hold a tone generator for no audible reason. Until
+                   its "note off" comes, each percussion note also holds a place in the
+                   output queue for its stop command, so with many drum notes at once
+                   -queuesize may need to be bigger. (Only valid with -pt.)
+
+  -importance      When there isn't a free tone generator for a note, stop the least important
+                   playing note to make room for it if the new note is more important. A note's
+                   importance is based on its volume, whether it is the highest note playing in
+                   its track (probably the melody), whether it is the lowest note playing (the
+                   bass line), and its duration. -showskipped reports the importance of the
+                   notes that are skipped or stopped.
+
+  -recover         Remember notes that had to be skipped because there weren't enough tone
+                   generators, and if a generator becomes free before the note was supposed to
+                   end, start the most important of them late. A note started late gives way
+                   to a note that is starting on time. The skipped notes are still reported,
+                   along with how many of them were started late.
+
+  -consolidate=x   Remove notes that start and stop within x milliseconds of an identical note
+                   on the same instrument, keeping the more important of the two. Unlike
+                   -noduplicates, the times don't have to be exactly the same. The number of
+                   tone generators saved at the peak is reported.
+
+  -octavefold      With -consolidate, also remove notes that are a whole number of octaves
+                   from the note they nearly duplicate.
+
+  -anyinstrument   With -consolidate, also remove notes played by a different instrument.
+
+  -splitchannels   If the MIDI file is format 0, which has all the channels in one track,
+                   treat each channel as a separate track. That lets the strategies that work
+                   track by track, like -s1 and -s2, do what they do for format 1 files.
+
+  -channelnotes=n  Allow up to n notes to play at once on each channel, instead of 16. Notes
+                   beyond that are dropped, which the summary reports. Files with hundreds
+                   of tracks and millions of notes ("black MIDI") need several hundred.
+                   There is no limit on the number of tracks.
+
+  -queuesize=n     Use an output queue of n play and stop commands, instead of 100. When it is
+                   too small for the number of notes starting at once, some stop commands are
+                   delayed, which the summary reports. -percussionmax uses more of it. A
+                   bigger queue is slower.
+
+  -manifest=list   Convert all the MIDI files named in the file "list", one per line,
+                   instead of just <basefilename>. Blank lines and lines starting with #
+                   are ignored. A name may be followed by a tab and the file's size in bytes.
+                   Each output file is put next to its MIDI file. A file that has errors
+                   is reported and skipped. "--manifest=list" also works.
+
+  -shard=i/n       With -manifest, divide the files into n shards of about the same total
+                   size, and convert only the files in shard i, 1 to n. Every computer
+                   that uses the same manifest makes the same division, so n of them can
+                   share the work without talking to each other. A report of what was
+                   done, in JSON format, is written to <list>.shard-i-of-n.json.
+
+  -mergereports=out  Combine the JSON reports whose names follow into one report, "out".
+
+  -jobs=n          With -manifest, convert the files with n processes at once. Each does
+                   part of the shard and the reports are combined. The files in each shard
+                   are the same whatever n is. Not on Windows.
+
+  -tar=archive     Convert the MIDI files in a tar archive without extracting them first.
+                   The archive may be compressed with gzip, which must then be installed;
+                   "-tar=-" reads an uncompressed archive from standard input. Each
+                   member whose name ends with .mid is converted from memory, and its
+                   output files are written with the same path under -outdir. Members
+                   whose names start with / or contain .. are skipped. The report, like
+                   the one for -manifest, is written to <archive>.json. -jobs may be used.
+
+  -outdir=dir      With -tar, the directory to write the output files under. The default
+                   is the current directory.
+
+  -outtar=out.tar  With -tar, put the output files into a new tar archive instead of
+                   leaving them on disk. Files that fail to convert are left out.
+
+  -scan            Instead of converting the MIDI file, profile it into the spreadsheet
+                   file <basefilename>.scan.csv, or with -manifest, <list>.shard-i-of-n.scan.csv.
+                   There is a line for the whole song and one for each channel that plays
+                   notes, giving the duration, the number of tracks and tempo changes, the
+                   number of notes, the peak and average number sounding at once, the
+                   range of notes, and the instruments used. That helps choose -t, -c and
+                   the hardware. It is about ten times faster than converting.
+
+  -estimate        Instead of converting the MIDI file, quickly estimate what converting it
+                   with these options would do for each -t from 1 up: how many notes would be
+                   skipped, and about how big the bytestream would be. It also shows how
+                   many tone generators are needed to play every note. The estimate uses a
+                   simple model of the tone generators that ignores -importance, -recover,
+                   -releasetime and the sustain phases of skipped notes, but it is usually
+                   within 1%. It assumes the output queue is big enough, so when the
+                   conversion reports delayed stop commands (see -queuesize), the
+                   bytestream can be several percent bigger than the estimate. With
+                   -manifest, the report has the estimates.
+
+  -stats           Show how long each phase of converting a file took: reading it and
+                   creating the output file, decoding the headers, converting the tracks,
+                   and finishing the output. On Linux, also show the cycles, instructions,
+                   cache misses and branch misses counted by the hardware performance
+                   counters for each phase, if the system allows it. With -manifest, the
+                   report has the same information for each file.
+
+  -pipeline        Format and write the C source code output in a separate thread, so
+                   that it overlaps with the conversion. That helps most for big scores.
+                   The output is the same as without -pipeline. Not on Windows.
+
+  -events          Also write the play and stop events as they are queued to the file
+                   <basefilename>.events. They have been merged from all the tracks in
+                   time order, with the tempo applied, the key shift or percussion
+                   translation done, and the sustain and release times computed, but no
+                   tone generators have been assigned yet. The file is columnar, and all
+                   numbers are little-endian:
+                      "MTev"      4 bytes identifying the file
+                      version     2 bytes, currently 1
+                      columns     2 bytes, currently 7
+                      n           4 bytes, the number of events
+                      time_usec   n 4-byte times, in microseconds from the start
+                      track       n 2-byte track numbers
+                      channel     n 2-byte channel numbers, plus 16 times the MIDI port
+                      note        n 1-byte notes, with percussion at 128 to 255 for -pt
+                      instrument  n 1-byte instruments
+                      volume      n 1-byte volumes
+                      kind        n 1-byte kinds: 0 play, 1 sustain phase, 2 stop
+                   so each column can be read directly as an array.
+
+  -readevents=file Convert an events file to the spreadsheet file <file>.csv, with a line
+                   for each event.
+
+  -map             Also write a source map, <basefilename>.map, that tells where each note
+                   and instrument command in the bytestream came from. "miditones_scroll -m"
+                   uses it to show the source of each command, so a problem it finds at some
+                   address can be traced back to the MIDI file. All numbers are little-endian:
+                      "MTmp"      4 bytes identifying the file
+                      version     2 bytes, currently 1
+                      size        2 bytes, the size of each record, currently 14
+                      n           4 bytes, the number of records
+                   and then n records in the order of the commands, each with
+                      offset      4 bytes, the command's position in the bytestream,
+                                  counting the -d header if there is one
+                      tick        4 bytes, the MIDI time of the event it came from
+                      track       2 bytes
+                      channel     2 bytes, plus 16 times the MIDI port
+                      note        1 byte, with percussion at 128 to 255 for -pt
+                      reason      1 byte: 0 play, 1 sustain phase, 2 stop, 3 instrument change
+                   The tick of a sustain phase is that of the note's start.
+
+  -diff=old.bin    Compare the music in two bytestream files, "-diff=old.bin new.bin", no
+                   matter which tone generators play the notes. Both are decoded into notes
+                   with a start time, length, pitch, volume and instrument, and notes of the
+                   same pitch and instrument are paired if they start close together, making
+                   as many pairs as possible, and of those, the closest ones. Each
+                   difference is shown with its time: notes that were removed or added, and
+                   paired notes that were shifted, truncated, lengthened or changed in volume.
+                   A note replayed on the same generator without a stop, like a sustain
+                   phase, counts as a new note. Use -v for files without a header that have
+                   volumes. The exit code is 0 if the music is the same, and 1 if not.
+
+  -difftime=x      With -diff, pair notes that start up to x msec apart. The default is 50.
+
+  -merge=out.bin   Combine the bytestream files whose names follow into one, "out.bin", for
+                   example a melody and a separately converted drum track. Their notes are
+                   interleaved in time, and their tone generators are reassigned so that at
+                   most -t are used, or 16 without -t. The files are given in order of
+                   priority: when there isn't a free generator, a note replaces one still
+                   playing from a later file, or if there isn't one, it is dropped. The
+                   output has volumes, instruments and translated percussion if any input
+                   does, and a header if any input has one or -d is given. Use -v and -i for
+                   inputs without a header that have volumes or instruments.
+
+  -transform=out.bin  Copy the bytestream file whose name follows to "out.bin", shifting
+                   its notes by the -k key shift and multiplying its delays by -timescale,
+                   so that the key or speed can be changed without the MIDI file. Notes
+                   128 to 255, which are translated percussion, aren't shifted. The parts
+                   of a millisecond left over from scaling each delay are carried to the
+                   next one, so the timing doesn't drift. The header is copied, or added
+                   if there isn't one and -d is given. The file is read and written in one
+                   pass, a command at a time. Use -v for a file without a header that has
+                   volumes.
+
+  -timescale=p/q   With -transform, multiply the delays by p/q, so that -timescale=2 plays
+                   at half speed and -timescale=4/5 plays 25% faster. p and q may be from 1
+                   to 10000, and /q may be omitted.
+
   Note that for backwards compatibility and easier batch-file processing, the equal sign
   for specifying an option's numeric value may be omitted. Also, numeric values may be
   specified in hex as 0xhhhh.
@@ -394,6 +592,50 @@
        (Thanks to Jonathan Oakley for providing an example of the problem.)
       -But sometimes, to reduce the number of tone generators, it's helpful to eliminate
        identical notes. So add a -noduplicates option to do just that.
+ 18 October 2026, V2.5
+      -Add -maxinstruments to limit how many different instruments sound at once, for
+       players that can only hold a few instrument samples in memory at a time.
+      -Add -percussiongens to reserve tone generators for percussion, and -percussionmax
+       to stop percussion notes whose "note off" is late or missing.
+      -Give each note an "importance" based on melody and bass line detection, volume,
+       and duration. Add -importance to let important notes replace unimportant ones
+       when we run out of tone generators, and show the importance with -showskipped.
+      -Add -recover to start skipped notes late when a tone generator becomes free.
+      -Add -consolidate to remove notes that nearly duplicate others, optionally also
+       ones an octave or more apart (-octavefold) or on other instruments (-anyinstrument).
+      -Add -splitchannels to treat each channel of a format 0 MIDI file as a separate track.
+      -Use the MIDI port meta-event to support files with more than 16 channels. The channel
+       table grows as ports appear, and -c can mask up to 64 channels.
+      -Add -manifest to convert a list of files, -shard to split the list across several
+       computers that each write a JSON report, and -mergereports to combine the reports.
+      -Add -jobs to convert the files of a manifest in parallel, and -scan to quickly profile
+       MIDI files without converting them.
+      -Add -estimate to predict the skipped notes and bytestream size for each -t.
+      -Check that all the events in each track fit inside it before parsing the track, and
+       report the track and position of any that don't. Show positions past 64K correctly.
+      -When not logging, skip quickly over runs of controller, pressure, pitch bend and sysex events.
+      -Choose the routines that output the bytestream commands once, instead of testing
+       the output options for every command.
+      -Make the note information smaller, put the fields used for every event first in the
+       track status, and count the notes playing on each channel so idle ones are skipped.
+      -Take the per-file memory (file buffer, channel note slots, output file buffer) from
+       an arena that is reset all at once between files, and report how much was used.
+      -Add -stats to time each phase of a conversion and count its hardware events.
+      -Add -pipeline to format the C source output in a separate thread.
+      -Add -tar to convert the MIDI files in a tar or tar.gz archive directly, with the
+       output going to a directory (-outdir) or to another archive (-outtar).
+      -Remove the limit of 24 tracks, add -channelnotes and -queuesize, and find the next
+       track with a heap, find notes in the channel slots and judge their importance with
+       indexes, so that files with hundreds of tracks and millions of notes go quickly.
+       "make bench" generates such a file with blackmidi.py and times its conversion.
+      -Add -events to export the queued play and stop events as a columnar binary file,
+       and -readevents to print one.
+      -Add -map to write a source map giving the MIDI track, tick, channel and note, and
+       the reason, for each command in the bytestream.
+      -Add -diff to compare the notes of two bytestreams independently of the tone
+       generators that play them.
+      -Add -merge to combine bytestreams, reassigning their tone generators within a budget.
+      -Add -transform to change the key (-k) and speed (-timescale) of a bytestream.
 
 future version ideas
 
@@ -409,7 +651,7 @@ future version ideas
         channel 8 // organ
             options -attacktime=1000 -sustainlevel=80% -releasetime=100 -notemin=200
 */
-#define VERSION "2.4"
+#define VERSION "2.5"
 
 /*--------------------------------------------------------------------------------------------
 
@@ -572,8 +814,28 @@ output queue entries at the oldest time
 #include <time.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <setjmp.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#define popen _popen
+#define pclose _pclose
+#else
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 typedef unsigned char byte;
 typedef uint32_t timestamp;  // see note about this in the queuing routines
+#define MAXPATH 1024
 
 /***********  MIDI file header formats  *****************/
 
@@ -592,24 +854,52 @@ struct track_header {
 
 #define MAX_TONEGENS 16         // max tone generators: tones we can play simultaneously
 #define DEFAULT_TONEGENS 6      // default number of tone generators
-#define MAX_TRACKS 24           // max number of MIDI tracks we will process
 #define PERCUSSION_TRACK 9      // the track MIDI uses for percussion sounds
 #define NUM_CHANNELS 16         // MIDI-specified number of channels
-#define MAX_CHANNELNOTES 16     // max number of notes playing simultaneously on a channel
+#define DEFAULT_CHANNELNOTES 16 // default max number of notes playing simultaneously on a channel
+#define DEFAULT_QUEUE_SIZE 100  // default max number of note play/stop commands we queue
 #define DEFAULT_TEMPO 500000L   // the MIDI-specified default tempo in usec/beat 
 #define DEFAULT_BEATTIME 240    // the MIDI-specified default ticks per beat 
 
 bool loggen, logparse, parseonly, strategy1, strategy2, binaryoutput, define_progmem,
      volume_output, instrumentoutput, percussion_ignore, percussion_translate, do_header,
-     gen_restart, scorename, showskipped, noduplicates;
+     gen_restart, scorename, showskipped, noduplicates, preempt_notes, recover_notes,
+     octave_fold, any_instrument, split_channels;
+const char *manifest_name = NULL;     // for -manifest, the file listing the MIDI files to convert
+int shard_num = 1, num_shards = 1;    // for -shard, which of how many shards of the manifest we convert
+const char *mergereports_name = NULL; // for -mergereports, the combined report to create
+jmp_buf *conversion_error = NULL;     // if converting many files, where to go when one of them fails
+int num_jobs = 1;                     // for -jobs, how many processes convert the files of a manifest
+const char *tar_name = NULL;          // for -tar, the archive of MIDI files to convert
+const char *outdir_name = NULL;       // for -outdir, the directory to write the output files into
+const char *outtar_name = NULL;       // for -outtar, the archive to put the output files into
+uint8_t *input_data = NULL;           // if not NULL, the MIDI file is already in memory here
+unsigned long input_length = 0;       //   and is this long
+bool scan_only = false;               // for -scan, profile the MIDI files instead of converting them
+bool estimate_only = false;           // for -estimate, estimate the results instead of converting
+bool scanning = false;                // doing either of those, which don't generate a bytestream
+FILE *scanfile = NULL;                // if converting many files, where -scan writes the profiles
+bool stats = false;                   // for -stats, measure each phase of the conversion
+bool pipeline = false;                // for -pipeline, format the C source output in another thread
+bool export_events = false;           // for -events, write the queued play and stop events to a file
+const char *readevents_name = NULL;   // for -readevents, the events file to print
+bool make_map = false;                // for -map, write where each command in the bytestream came from
+const char *diff_name = NULL;         // for -diff, the bytestream to compare another one to
+unsigned diff_msec = 50;              // for -difftime, notes starting this close together are paired
+const char *merge_name = NULL;        // for -merge, the bytestream to create from others
+const char *transform_name = NULL;    // for -transform, the bytestream to create from another
+unsigned long timescale_num = 1, timescale_den = 1; // for -timescale, the fraction to multiply delays by
 FILE *infile, *outfile, *logfile;
 uint8_t *buffer, *hdrptr;
 unsigned long buflen;
 int num_tracks;
+int format_type;
+bool split_format0 = false;  // are we splitting a format 0 file into virtual tracks for -splitchannels?
 int tracks_done = 0;
 int outfile_maxitems = 26;
 int outfile_itemcount = 0;
 int num_tonegens = DEFAULT_TONEGENS;
+bool tonegens_given = false;        // was -t given?
 int num_tonegens_used = 0;
 int instrument_changes = 0;
 int note_on_commands = 0;
@@ -622,14 +912,25 @@ int sustainphases_done = 0;
 int consecutive_delays = 0;
 bool last_output_was_delay = false;
 int noteinfo_overflow = 0, noteinfo_notfound = 0;
-unsigned channel_mask = 0xffff;     // bit mask of channels to process
+uint64_t channel_mask = UINT64_MAX; // bit mask of channels to process, 16 for each MIDI port
 int keyshift = 0;                   // optional chromatic note shift for output file
+int channel_notes = DEFAULT_CHANNELNOTES; // for -channelnotes, the most notes that can play at once on a channel
+int queue_size = DEFAULT_QUEUE_SIZE;      // for -queuesize, the most play/stop commands we queue
 unsigned long delaymin_usec = 0;    // events this close get merged together to save bytestream space
 unsigned long releasetime_usec = 0; // release time in usec for silence at the end of notes
 unsigned long notemin_usec = 250;   // minimum note time in usec after the release is deducted
 unsigned long attacktime_usec = 0;  // the high volume attack phase lasts this time, if not 0 (only for -v)
 unsigned long attacknotemax_usec = ULONG_MAX; // the longest note to which the attack/sustain profile is used (only for -v)
 int sustainlevel_pct = 50;          // the percent of attack volume for the sustain phase (only for -v)
+int max_instruments = 0;            // if not 0, the most different instruments that may sound at once
+int instrument_limit_remaps = 0, instrument_limit_drops = 0; // what -maxinstruments had to do
+int percussion_tonegens = 0;        // how many of the last tone generators are reserved for percussion
+unsigned long percussionmax_usec = 0; // if not 0, stop percussion notes this long after they start
+int percussion_notes_released = 0;  // how many percussion notes were stopped by -percussionmax
+int notes_preempted = 0;            // how many playing notes were stopped for more important ones
+int notes_recovered = 0;            // how many skipped notes were started late by -recover
+unsigned long consolidate_usec = 0; // if not 0, notes starting and ending this close together are merged
+int notes_consolidated = 0;         // how many notes -consolidate removed
 long int outfile_bytecount = 0;
 unsigned int ticks_per_beat = DEFAULT_BEATTIME;
 
@@ -695,6 +996,19 @@ bool opt_int(const char* arg, const char* keyword, int *pval, int min, int max)
    *pval = num;
    return true; }
 
+bool opt_mask(const char* arg, const char* keyword, uint64_t *pval) {
+   do { // check for a "keyword=mask" option of up to 64 bits and nothing after it
+      if (tolower(*arg++) != *keyword++)
+         return false; }
+   while (*keyword);
+   if (*arg == '=') ++arg;
+   unsigned long long num;
+   int nch;
+   if (sscanf(arg, *arg == '0' && *(arg + 1) == 'x' ? "%llx%n" : "%llu%n", &num, &nch) != 1) return false;
+   if (num == 0 || arg[nch] != '\0') return false;
+   *pval = num;
+   return true; }
+
 bool opt_str(const char* arg, const char* keyword, const char** str) {
    do { // check for a "keyword=string" option
       if (tolower(*arg++) != *keyword++) return false; }
@@ -742,6 +1056,40 @@ void SayUsage(char *programName) {
       "  -releasetime=x    release each note x msec before it ends",
       "  -notemin=x        don't let release shorten the note to less than x msec",
       "  -scorename        use <basefilename> as the score name in a .h file",
+      "  -maxinstruments=k at most k different instruments sound at the same time",
+      "  -percussiongens=n reserve the last n tone generators for percussion (with -pt)",
+      "  -percussionmax=x  stop percussion notes at most x msec after they start (with -pt)",
+      "  -importance       let more important notes replace less important ones",
+      "  -recover          start skipped notes late if a tone generator becomes free",
+      "  -consolidate=x    remove notes starting and ending within x msec of an identical one",
+      "  -octavefold       with -consolidate, also remove notes whole octaves apart",
+      "  -anyinstrument    with -consolidate, also remove notes on other instruments",
+      "  -splitchannels    treat each channel of a format 0 file as a separate track",
+      "  -channelnotes=n   allow n notes at once on each channel (default 16)",
+      "  -queuesize=n      queue n play and stop commands (default 100)",
+      "",
+      "Converting many files:",
+      "  -manifest=list    convert the MIDI files named in the list, one per line",
+      "  -shard=i/n        with -manifest, convert only shard i of n, and write a",
+      "                    report to <list>.shard-i-of-n.json",
+      "  -mergereports=out <report>...  combine shard reports into one",
+      "  -jobs=n           with -manifest, convert n files at a time",
+      "  -tar=archive      convert the MIDI files in a tar archive, which may be gzipped",
+      "  -outdir=dir       with -tar, write the output files under this directory",
+      "  -outtar=archive   with -tar, put the output files into a new tar archive",
+      "  -scan             profile the polyphony, notes and instruments of each file",
+      "                    into <basefilename>.scan.csv, without converting it",
+      "  -estimate         estimate the notes skipped and the bytes for each -t, without converting",
+      "  -stats            show the time, and on Linux the hardware counts, for each phase",
+      "  -pipeline         format the C source output in a separate thread",
+      "  -events           also write the queued play and stop events to <basefilename>.events",
+      "  -readevents=file  convert an events file to CSV in <file>.csv",
+      "  -map              write the source of each bytestream command to <basefilename>.map",
+      "  -diff=old.bin new.bin  compare the notes in two bytestreams, regardless of generators",
+      "  -difftime=x       with -diff, notes starting up to x msec apart may be the same (default 50)",
+      "  -merge=out.bin <bytestream>...  combine bytestreams, using at most -t tone generators",
+      "  -transform=out.bin in.bin  copy a bytestream, shifting the notes by -k and scaling by -timescale",
+      "  -timescale=p/q    with -transform, multiply the delays by p/q",
       NULL };
    for (int i=0; usage[i] != NULL; ++i)
       fprintf(stderr, "%s\n", usage[i]); }
@@ -753,12 +1101,14 @@ int HandleOptions (int argc, char *argv[]) {
    for (i = 1; i < argc; i++) {
       if (argv[i][0] == '/' || argv[i][0] == '-') {
          int tempint;
+         const char *tempstr;
          char *arg = argv[i] + 1;
+         if (*arg == '-') ++arg; // allow --option too
          if (opt_key(arg, "h") || opt_key(arg, "?")) {
             SayUsage(argv[0]); exit(1); }
          else if (opt_key(arg, "b")) binaryoutput = true;
-         else if (opt_int(arg, "c", &channel_mask, 1, 0xffff))
-            printf("Channel (track) mask is %04X\n", channel_mask);
+         else if (opt_mask(arg, "c", &channel_mask))
+            printf("Channel (track) mask is %04" PRIX64 "\n", channel_mask);
          else if (opt_key(arg, "d")) do_header = true;
          else if (opt_key(arg, "dp")) define_progmem = true;
          else if (opt_key(arg, "lg")) loggen = true;
@@ -787,8 +1137,50 @@ int HandleOptions (int argc, char *argv[]) {
          else if (opt_key(arg, "scorename")) scorename = true;
          else if (opt_key(arg, "showskipped")) showskipped = true;
          else if (opt_key(arg, "noduplicates")) noduplicates = true;
-         else if (opt_int(arg, "t", &num_tonegens, 1, MAX_TONEGENS))
-            printf("Using %d tone generators\n", num_tonegens);
+         else if (opt_int(arg, "maxinstruments", &max_instruments, 1, 128));
+         else if (opt_key(arg, "importance")) preempt_notes = true;
+         else if (opt_key(arg, "recover")) recover_notes = true;
+         else if (opt_int(arg, "consolidate", &tempint, 1, 1000)) consolidate_usec = tempint * 1000;
+         else if (opt_key(arg, "octavefold")) octave_fold = true;
+         else if (opt_key(arg, "anyinstrument")) any_instrument = true;
+         else if (opt_key(arg, "splitchannels")) split_channels = true;
+         else if (opt_str(arg, "manifest=", &manifest_name));
+         else if (opt_str(arg, "shard=", &tempstr))
+            check_option(sscanf(tempstr, "%d/%d", &shard_num, &num_shards) == 2
+                         && num_shards >= 1 && shard_num >= 1 && shard_num <= num_shards,
+                         "-shard must be i/n, with i from 1 to n");
+         else if (opt_str(arg, "mergereports=", &mergereports_name));
+         else if (opt_str(arg, "tar=", &tar_name));
+         else if (opt_str(arg, "outdir=", &outdir_name));
+         else if (opt_str(arg, "outtar=", &outtar_name));
+         else if (opt_int(arg, "jobs", &num_jobs, 1, 256));
+         else if (opt_key(arg, "scan")) scan_only = true;
+         else if (opt_key(arg, "estimate")) estimate_only = true;
+         else if (opt_key(arg, "stats")) stats = true;
+         else if (opt_key(arg, "pipeline")) pipeline = true;
+         else if (opt_key(arg, "events")) export_events = true;
+         else if (opt_str(arg, "readevents=", &readevents_name));
+         else if (opt_key(arg, "map")) make_map = true;
+         else if (opt_str(arg, "diff=", &diff_name));
+         else if (opt_int(arg, "difftime", &tempint, 0, 10000)) diff_msec = tempint;
+         else if (opt_str(arg, "merge=", &merge_name));
+         else if (opt_str(arg, "transform=", &transform_name));
+         else if (opt_str(arg, "timescale=", &tempstr)) {
+            int fields = sscanf(tempstr, "%lu/%lu", &timescale_num, &timescale_den);
+            if (fields == 1) timescale_den = 1;
+            check_option(fields >= 1 && timescale_num >= 1 && timescale_den >= 1
+                         && timescale_num <= 10000 && timescale_den <= 10000,
+                         "-timescale must be p or p/q, with p and q from 1 to 10000"); }
+         else if (opt_int(arg, "percussiongens", &percussion_tonegens, 1, MAX_TONEGENS - 1))
+            check_option(percussion_translate, "-percussiongens only works with -pt");
+         else if (opt_int(arg, "percussionmax", &tempint, 1, INT_MAX)) {
+            percussionmax_usec = tempint * 1000;
+            check_option(percussion_translate, "-percussionmax only works with -pt"); }
+         else if (opt_int(arg, "channelnotes", &channel_notes, 1, 4096));
+         else if (opt_int(arg, "queuesize", &queue_size, 2, 100000));
+         else if (opt_int(arg, "t", &num_tonegens, 1, MAX_TONEGENS)) {
+            tonegens_given = true;
+            printf("Using %d tone generators\n", num_tonegens); }
          else if (opt_key(arg, "v")) volume_output = true;
          /* add more  option switches here */
          else {
@@ -808,21 +1200,79 @@ void print_command_line (FILE *file, int argc, char *argv[]) {
 
 /****************  utility routines  **********************/
 
+/* All the memory for converting one file comes from an arena. We hand out pieces of big
+   blocks in order, and when we're done with the file we take it all back at once by
+   starting again at the first block. That avoids a malloc and free for each structure,
+   and the fragmentation that would cause when converting many files. The blocks are
+   kept for the next file. */
+
+#define ARENA_BLOCKSIZE (1024*1024)
+#define OUTFILE_BUFSIZE (64*1024) // the output file's buffer comes from the arena too
+
+struct arena_block {
+   struct arena_block *next;   // the next block, if we've needed one before
+   size_t size, used;          // how big the data area is, and how much is handed out
+   byte *data; } *arena_first = NULL, *arena_current = NULL;
+size_t arena_in_use = 0, arena_peak = 0; // bytes handed out now, and the most ever
+
+void *arena_alloc(size_t size) { // returns NULL if there isn't enough memory
+   size = (size + 15) & ~(size_t)15; // keep everything aligned
+   while (!arena_current || arena_current->used + size > arena_current->size) {
+      struct arena_block *next = arena_current ? arena_current->next : arena_first;
+      if (!next || next->size < size) { // we need a new block, after the current one
+         size_t blocksize = size > ARENA_BLOCKSIZE ? size : ARENA_BLOCKSIZE;
+         struct arena_block *block = (struct arena_block *) malloc(sizeof(struct arena_block));
+         if (!block || !(block->data = (byte *) malloc(blocksize))) {
+            free(block);
+            return NULL; }
+         block->size = blocksize;
+         block->next = next;
+         if (arena_current) arena_current->next = block;
+         else arena_first = block;
+         next = block; }
+      next->used = 0;
+      arena_current = next; }
+   void *ptr = arena_current->data + arena_current->used;
+   arena_current->used += size;
+   arena_in_use += size;
+   if (arena_in_use > arena_peak) arena_peak = arena_in_use;
+   return ptr; }
+
+// make an arena allocation bigger; the old space is only reclaimed when the arena is reset
+void *arena_grow(void *old, size_t oldsize, size_t newsize) {
+   byte *ptr = arena_alloc(newsize);
+   if (ptr && old)
+      for (size_t i = 0; i < oldsize; ++i) ptr[i] = ((byte *) old)[i];
+   return ptr; }
+
+void arena_reset(void) { // free everything
+   arena_current = arena_first;
+   if (arena_current) arena_current->used = 0;
+   arena_in_use = 0; }
+
 void assert(bool condition, char *msg) {
    if (!condition) {
       fprintf(stderr, "*** internal assertion error: %s\n", msg);
       if (logfile) fprintf(logfile, "*** internal assertion error: %s\n", msg);
+      if (conversion_error) longjmp(*conversion_error, 1); // just give up on this file
       exit(8); } }
 
+/* announce that we ran out of memory for something the file needs */
+void out_of_memory(const char *what, unsigned long count) {
+   fprintf(stderr, "Unable to allocate memory for %lu %s\n", count, what);
+   if (conversion_error) longjmp(*conversion_error, 1); // just give up on this file
+   exit(8); }
+
 /* announce a fatal MIDI file format error */
 void midi_error(char *msg, byte *bufptr) {
-   fprintf(stderr, "---> MIDI file error at position %04X (%d): %s\n",
-           (uint16_t)(bufptr - buffer), (uint16_t)(bufptr - buffer), msg);
+   fprintf(stderr, "---> MIDI file error at position %04lX (%lu): %s\n",
+           (unsigned long)(bufptr - buffer), (unsigned long)(bufptr - buffer), msg);
    byte *ptr = bufptr - 16;   // print some bytes surrounding the error
    if (ptr < buffer) ptr = buffer;
    for (; ptr <= bufptr + 16 && ptr < buffer + buflen; ++ptr)
       fprintf(stderr, ptr == bufptr ? " [%02X]  " : "%02X ", *ptr);
    fprintf(stderr, "\n");
+   if (conversion_error) longjmp(*conversion_error, 1); // just give up on this file
    exit(8); }
 
 /* portable string length */
@@ -891,10 +1341,177 @@ and generate a newline every so often. */
 void outfile_items (int n) {
    outfile_bytecount += n;
    outfile_itemcount += n;
-   if (!binaryoutput && outfile_itemcount >= outfile_maxitems) {
+   if (outfile_itemcount >= outfile_maxitems) {
       fprintf (outfile, "\n");
       outfile_itemcount = 0; } }
 
+/**************  output the bytestream commands  *****************/
+
+/* There is a version of each output routine for binary and for C source code output,
+and for playing notes with and without volume. choose_output() picks the ones to use
+once, so that we don't test the options for every command we output. */
+
+void bin_play(int tgnum, int note, int volume) {
+   putc(CMD_PLAYNOTE | tgnum, outfile);
+   putc(note, outfile);
+   outfile_bytecount += 2; }
+
+void bin_play_volume(int tgnum, int note, int volume) {
+   putc(CMD_PLAYNOTE | tgnum, outfile);
+   putc(note, outfile);
+   putc(volume, outfile);
+   outfile_bytecount += 3; }
+
+void bin_stop(int tgnum) {
+   putc(CMD_STOPNOTE | tgnum, outfile);
+   outfile_bytecount += 1; }
+
+void bin_instrument(int tgnum, int instrument) {
+   putc(CMD_INSTRUMENT | tgnum, outfile);
+   putc(instrument, outfile);
+   outfile_bytecount += 2; }
+
+void bin_delay(unsigned long delta_msec) { // a 15-bit delay in big-endian format
+   putc((byte)(delta_msec >> 8), outfile);
+   putc((byte)(delta_msec & 0xff), outfile);
+   outfile_bytecount += 2; }
+
+void bin_end(int cmd) {
+   putc(cmd, outfile);
+   outfile_bytecount += 1; }
+
+void c_play(int tgnum, int note, int volume) {
+   fprintf(outfile, "0x%02X,%d, ", CMD_PLAYNOTE | tgnum, note);
+   outfile_items(2); }
+
+void c_play_volume(int tgnum, int note, int volume) {
+   fprintf(outfile, "0x%02X,%d,%d, ", CMD_PLAYNOTE | tgnum, note, volume);
+   outfile_items(3); }
+
+void c_stop(int tgnum) {
+   fprintf(outfile, "0x%02X, ", CMD_STOPNOTE | tgnum);
+   outfile_items(1); }
+
+void c_instrument(int tgnum, int instrument) {
+   fprintf(outfile, "0x%02X,%d, ", CMD_INSTRUMENT | tgnum, instrument);
+   outfile_items(2); }
+
+void c_delay(unsigned long delta_msec) {
+   fprintf(outfile, "%ld,%ld, ", delta_msec >> 8, delta_msec & 0xff);
+   outfile_items(2); }
+
+void c_end(int cmd) {
+   fprintf(outfile, "0x%02X};", cmd);
+   outfile_items(1);
+   fprintf(outfile, "\n"); }
+
+void no_instrument(int tgnum, int instrument) { } // without -i, instrument changes aren't output
+
+void (*output_play)(int tgnum, int note, int volume);
+void (*output_stop)(int tgnum);
+void (*output_instrument)(int tgnum, int instrument);
+void (*output_delay)(unsigned long delta_msec);
+void (*output_end)(int cmd);
+
+void choose_output(void) {
+   output_play = binaryoutput ? (volume_output ? bin_play_volume : bin_play) : (volume_output ? c_play_volume : c_play);
+   output_stop = binaryoutput ? bin_stop : c_stop;
+   output_instrument = !instrumentoutput ? no_instrument : binaryoutput ? bin_instrument : c_instrument;
+   output_delay = binaryoutput ? bin_delay : c_delay;
+   output_end = binaryoutput ? bin_end : c_end; }
+
+/* With -pipeline, the C source code output is formatted and written by a second thread,
+   so that it overlaps with the conversion. The conversion hands it each command as a
+   4-byte record through a bounded ring that has only one writer and one reader, so it
+   needs no locks. The formatter uses the same routines as without -pipeline, in the
+   same order, so the output is identical. Binary output is cheap enough to write directly. */
+
+#ifndef _WIN32
+#define EMIT_RINGSIZE 4096      // records in the ring; must be a power of 2
+enum emit_kind {EMIT_PLAY, EMIT_PLAY_VOLUME, EMIT_STOP, EMIT_INSTRUMENT, EMIT_DELAY, EMIT_END };
+struct emit_record {
+   byte kind, tgnum;            // which command, and for which tone generator
+   byte a, b;                   // the note and volume, the instrument, or the delay high and low bytes
+} emit_ring[EMIT_RINGSIZE];
+atomic_uint emit_head, emit_tail; // the next record to write, and the next to read
+atomic_bool emit_closing;         // no more records are coming
+pthread_t emit_thread;
+bool emit_running = false;
+
+void emit_put(byte kind, byte tgnum, byte a, byte b) {
+   unsigned head = atomic_load_explicit(&emit_head, memory_order_relaxed);
+   while (head - atomic_load_explicit(&emit_tail, memory_order_acquire) >= EMIT_RINGSIZE)
+      sched_yield(); // the ring is full: let the formatter catch up
+   struct emit_record *rp = &emit_ring[head % EMIT_RINGSIZE];
+   rp->kind = kind; rp->tgnum = tgnum; rp->a = a; rp->b = b;
+   atomic_store_explicit(&emit_head, head + 1, memory_order_release); }
+
+void emit_play(int tgnum, int note, int volume) {
+   emit_put(volume_output ? EMIT_PLAY_VOLUME : EMIT_PLAY, tgnum, note, volume); }
+
+void emit_stop(int tgnum) {
+   emit_put(EMIT_STOP, tgnum, 0, 0); }
+
+void emit_instrument(int tgnum, int instrument) {
+   emit_put(EMIT_INSTRUMENT, tgnum, instrument, 0); }
+
+void emit_delay(unsigned long delta_msec) {
+   emit_put(EMIT_DELAY, 0, delta_msec >> 8, delta_msec & 0xff); }
+
+void emit_end(int cmd) {
+   emit_put(EMIT_END, 0, cmd, 0); }
+
+void *emit_formatter(void *arg) { // the thread that formats and writes the records
+   unsigned tail = atomic_load_explicit(&emit_tail, memory_order_relaxed);
+   while (true) {
+      unsigned head = atomic_load_explicit(&emit_head, memory_order_acquire);
+      if (tail == head) { // nothing to do
+         if (atomic_load(&emit_closing) && tail == atomic_load(&emit_head)) break;
+         sched_yield();
+         continue; }
+      for (; tail != head; ++tail) {
+         struct emit_record *rp = &emit_ring[tail % EMIT_RINGSIZE];
+         switch (rp->kind) {
+         case EMIT_PLAY: c_play(rp->tgnum, rp->a, 0); break;
+         case EMIT_PLAY_VOLUME: c_play_volume(rp->tgnum, rp->a, rp->b); break;
+         case EMIT_STOP: c_stop(rp->tgnum); break;
+         case EMIT_INSTRUMENT: c_instrument(rp->tgnum, rp->a); break;
+         case EMIT_DELAY: c_delay(((unsigned long)rp->a << 8) | rp->b); break;
+         case EMIT_END: c_end(rp->a); break; }
+         atomic_store_explicit(&emit_tail, tail + 1, memory_order_release); } }
+   return NULL; }
+
+void emit_start(void) { // start the formatter thread, if we can
+   atomic_store(&emit_head, 0);
+   atomic_store(&emit_tail, 0);
+   atomic_store(&emit_closing, false);
+   if (pthread_create(&emit_thread, NULL, emit_formatter, NULL) != 0) {
+      printf("  Unable to start the output thread, so -pipeline is ignored\n");
+      return; }
+   emit_running = true;
+   output_play = emit_play;
+   output_stop = emit_stop;
+   if (instrumentoutput) output_instrument = emit_instrument;
+   output_delay = emit_delay;
+   output_end = emit_end; }
+
+void emit_drain(void) { // wait until everything handed to the formatter has been written
+   if (emit_running)
+      while (atomic_load_explicit(&emit_tail, memory_order_acquire) != atomic_load_explicit(&emit_head, memory_order_relaxed))
+         sched_yield(); }
+
+void emit_finish(void) { // write everything, and stop the formatter thread
+   if (emit_running) {
+      atomic_store(&emit_closing, true);
+      pthread_join(emit_thread, NULL);
+      emit_running = false;
+      choose_output(); } }
+#else
+void emit_start(void) { }
+void emit_drain(void) { }
+void emit_finish(void) { }
+#endif
+
 //******* structures for recording track, channel, and tone generator status
 
 // Note that the tempo can change while notes are being played, maybe many times.
@@ -906,34 +1523,108 @@ void outfile_items (int n) {
 // accumulate the duration of all playing notes every time the tempo changes, and
 // then one final time when the "stop note" event occurs.
 
+enum event_kind { EVENT_PLAY, EVENT_SUSTAIN, EVENT_STOP, EVENT_INSTRUMENT };
+const char *event_kind_names[] = { "play", "sustain", "stop", "instrument" };
+
 struct noteinfo {                   // everything we might care about as a note plays
    timestamp time_usec;             // when it starts or stops, in absolute usec since song start
-   int track, channel, note, instrument, volume; // all the nitty-gritty about it
+   uint16_t track, channel;         // all the nitty-gritty about it, kept small because
+   byte note, instrument, volume;   //   we copy these around a lot in the queue
+   byte kind;                       // an event_kind: the start, the sustain phase, or the stop
+   int16_t importance;              // how much we want to keep it if there aren't enough tone generators
+   uint32_t tick;                   // the MIDI time, in ticks, of the event this came from
 };
 
 
+/* All 16 of these take 512 bytes, which stay in the L1 cache, so the scans of them in
+   find_idle_tgen() and remove_queue_entry() gain nothing from splitting out the fields they test. */
 struct tonegen_status {         // current status of a tone generator
    bool playing;                // is it playing?
    bool stopnote_pending;       // are we due to issue a stop note command?
    struct noteinfo note;        // if so, the details of the note being played
+   int requested_instrument;    // the instrument the note asked for, before any -maxinstruments change
+   bool started_late;           // is it a skipped note that -recover started late?
 } tonegen[MAX_TONEGENS] = { 0 };
 
-struct track_status {           // current status of a MIDI track
+struct track_status {           // current status of a MIDI track; what we look at for every event is first
    uint8_t *trkptr;             // ptr to the next event we care about
    uint8_t *trkend;             // ptr just past the end of the track
    unsigned long time;          // what time we're at in the score, in ticks
-   unsigned long tempo;         // the last tempo set by this track
-   int preferred_tonegen;       // for strategy2: try to use this generator
    byte cmd;                    // next CMD_xxxx event coming up
-   byte chan, note, volume;     // if it is CMD_PLAYNOTE or CMD_STOPNOTE, the note info
+   byte note, volume;           //   and if it is CMD_PLAYNOTE or CMD_STOPNOTE, the note info
    byte last_event;             // the last event, for MIDI's "running status"
-} track[MAX_TRACKS] = { 0 };
+   int chan;                    //   and the channel, numbered from 16*port
+   int port;                    // the MIDI port set by the last port meta-event, for more than 16 channels
+   int only_channel;            // for -splitchannels, the only channel this virtual track plays, or -1
+   int preferred_tonegen;       // for strategy2: try to use this generator
+   unsigned long tempo;         // the last tempo set by this track
+   uint8_t *trkstart;           // ptr to the first event in the track
+} *track = NULL;                // indexed by track number; there can be as many as the MIDI file has
 
 struct channel_status {          // current status of a channel
    int instrument;               // which instrument this channel currently plays
-   bool note_playing[MAX_CHANNELNOTES]; // slots for notes that are playing on this channel
-   struct noteinfo notes_playing[MAX_CHANNELNOTES]; // information about them
-} channel[NUM_CHANNELS] = { 0 };
+   int num_playing;              // how many of the slots are in use, so we can skip idle channels quickly
+   int first_free;               // all the slots before this one are in use
+   bool *note_playing;           // channel_notes slots for notes that are playing on this channel
+   struct noteinfo *notes_playing; // information about them
+   int *note_first;              // for each note 0..255, the first slot it's playing in, or -1
+   int *slot_next;               // for each slot, the next one playing the same note, or -1
+} *channel = NULL;               // indexed by 16*port + channel, and grown as ports appear
+int num_channels = 0;
+
+// make sure there is a channel status for all the channels of the port that this channel is in
+void make_channels(int channum) {
+   if (channum >= num_channels) {
+      int new_num_channels = (channum / NUM_CHANNELS + 1) * NUM_CHANNELS;
+      channel = (struct channel_status *) arena_grow(channel, num_channels * sizeof(struct channel_status),
+                new_num_channels * sizeof(struct channel_status));
+      if (!channel) out_of_memory("channels", new_num_channels);
+      static const struct channel_status empty_channel = { 0 };
+      for (int ndx = num_channels; ndx < new_num_channels; ++ndx) {
+         struct channel_status *cp = &channel[ndx];
+         *cp = empty_channel;
+         cp->note_playing = (bool *) arena_alloc(channel_notes * sizeof(bool));
+         cp->notes_playing = (struct noteinfo *) arena_alloc(channel_notes * sizeof(struct noteinfo));
+         cp->note_first = (int *) arena_alloc(256 * sizeof(int));
+         cp->slot_next = (int *) arena_alloc(channel_notes * sizeof(int));
+         if (!cp->note_playing || !cp->notes_playing || !cp->note_first || !cp->slot_next)
+            out_of_memory("channels", new_num_channels);
+         for (int slot = 0; slot < channel_notes; ++slot) cp->note_playing[slot] = false;
+         for (int note = 0; note < 256; ++note) cp->note_first[note] = -1; }
+      num_channels = new_num_channels; } }
+
+/* The slots of a channel's playing notes are also chained together by note, so that when a
+   note stops we only look at the slots playing that note. When there are two for the same
+   track, we use the one in the lowest slot, as if we had looked at them all in order. */
+int find_free_slot(struct channel_status *cp) { // returns -1 if there isn't one
+   for (int ndx = cp->first_free; ndx < channel_notes; ++ndx)
+      if (!cp->note_playing[ndx]) return ndx;
+   return -1; }
+
+void use_slot(struct channel_status *cp, int ndx, int note) {
+   cp->note_playing[ndx] = true;
+   ++cp->num_playing;
+   cp->first_free = ndx + 1; // this was the first free one
+   cp->slot_next[ndx] = cp->note_first[note];
+   cp->note_first[note] = ndx; }
+
+int find_note_slot(struct channel_status *cp, int note, int tracknum) { // returns -1 if it isn't playing
+   int found = -1;
+   for (int ndx = cp->note_first[note]; ndx >= 0; ndx = cp->slot_next[ndx])
+      if (cp->notes_playing[ndx].track == tracknum && (found < 0 || ndx < found)) found = ndx;
+   return found; }
+
+void free_slot(struct channel_status *cp, int ndx, int note) {
+   int *link = &cp->note_first[note];
+   while (*link != ndx) link = &cp->slot_next[*link];
+   *link = cp->slot_next[ndx];
+   cp->note_playing[ndx] = false;
+   --cp->num_playing;
+   if (ndx < cp->first_free) cp->first_free = ndx; }
+
+// is this channel, numbered from 16*port, one the -c mask says to process?
+bool channel_selected(int channum) {
+   return channum < 64 ? (channel_mask >> channum) & 1 : channel_mask == UINT64_MAX; }
 
 char *describe(struct noteinfo *np) { // create a description of a note
    // WARNING: returns a pointer to a static string, so only call once per line, in a printf!
@@ -946,6 +1637,70 @@ char *describe(struct noteinfo *np) { // create a description of a note
            np->track, np->channel, np->volume, np->instrument);
    return notedescription; }
 
+/************** the source map ******************
+
+With -map, we remember for each note and instrument command we put in the bytestream its
+byte offset, and the MIDI track, tick, channel and note it came from, and why. They are
+written at the end to <basefilename>.map as fixed-size records in the order of the offsets,
+so a program displaying the bytestream can find the source of each command directly.
+The format is described with the -map option. We count the bytes ourselves, because with
+-pipeline the output is written by another thread. */
+
+#define MAP_VERSION 1
+#define MAP_HEADER_SIZE 12
+#define MAP_RECORD_SIZE 14
+
+struct map_entry {
+   uint32_t offset, tick;
+   uint16_t track, channel;
+   byte note, kind; } *map_entries = NULL;
+unsigned long num_map_entries = 0, map_entries_room = 0;
+unsigned long map_offset = 0;    // the bytestream offset of the next command
+
+void map_command(enum event_kind kind, struct noteinfo *np, int bytes) {
+   if (num_map_entries >= map_entries_room) { // make room for more: double it
+      unsigned long room = map_entries_room ? 2 * map_entries_room : 4096;
+      map_entries = (struct map_entry *) arena_grow(map_entries,
+                    map_entries_room * sizeof(struct map_entry), room * sizeof(struct map_entry));
+      if (!map_entries) out_of_memory("source map entries", room);
+      map_entries_room = room; }
+   struct map_entry *mp = &map_entries[num_map_entries++];
+   mp->offset = map_offset;
+   mp->tick = np->tick;
+   mp->track = np->track;
+   mp->channel = np->channel;
+   mp->note = np->note;
+   mp->kind = kind;
+   map_offset += bytes; }
+
+void put_little_endian(FILE *file, unsigned long val, int bytes) {
+   for (int i = 0; i < bytes; ++i, val >>= 8) putc(val & 0xff, file); }
+
+bool write_map(const char *filebasename) { // returns false if we couldn't
+   char filename[MAXPATH];
+   miditones_strlcpy (filename, filebasename, MAXPATH);
+   miditones_strlcat (filename, ".map", MAXPATH);
+   FILE *file = fopen(filename, "wb");
+   if (!file) {
+      fprintf (stderr, "Unable to open source map file %s\n", filename);
+      return false; }
+   fwrite("MTmp", 1, 4, file);
+   put_little_endian(file, MAP_VERSION, 2);
+   put_little_endian(file, MAP_RECORD_SIZE, 2);
+   put_little_endian(file, num_map_entries, 4);
+   for (struct map_entry *mp = map_entries; mp < map_entries + num_map_entries; ++mp) {
+      put_little_endian(file, mp->offset, 4);
+      put_little_endian(file, mp->tick, 4);
+      put_little_endian(file, mp->track, 2);
+      put_little_endian(file, mp->channel, 2);
+      putc(mp->note, file);
+      putc(mp->kind, file); }
+   bool ok = !ferror(file);
+   if (fclose(file) != 0) ok = false;
+   if (!ok) fprintf(stderr, "Unable to write source map file %s\n", filename);
+   else printf("  The source of %lu commands was written to %s\n", num_map_entries, filename);
+   return ok; }
+
 /************** output reorder queue routines ******************
 
 We queue commands to be issued at arbitrary times and sort them in time order. We flush
@@ -964,13 +1719,11 @@ in a song. If they are 32 bits, the typical 480 ticks/beat and 500,000 usec/tick
 still plenty long.
 */
 
-#define QUEUE_SIZE 100    // maximum number of note play/stop commands we queue
-
 struct queue_entry {      // the format of each queue entry
+   struct noteinfo note;  // info about the note, including the action time
    byte cmd;              // CMD_PLAY or CMD_STOP
    byte delete;           // delete this command due to "-noduplicates"?
-   struct noteinfo note;  // info about the note, including the action time
-} queue[QUEUE_SIZE];
+} *queue = NULL;          // with room for queue_size entries
 
 int queue_numitems = 0;
 int queue_oldest_ndx = 0, queue_newest_ndx = 0;
@@ -986,7 +1739,7 @@ void show_queue(void) { // for debugging: dump the whole event queue
          struct queue_entry *q = &queue[ndx];
          fprintf(fid, "%2d: %s %s %s\n", ndx, q->cmd == CMD_PLAYNOTE ? "PLAY" : "STOP", q->delete ? "deleted" : "", describe(&q->note));
          if (ndx == queue_newest_ndx) break;
-         if (++ndx >= QUEUE_SIZE) ndx = 0; } }
+         if (++ndx >= queue_size) ndx = 0; } }
 
 void show_tonegens(void) { // for debugging: dump tone generator status
    FILE *fid = logfile;
@@ -1000,8 +1753,43 @@ void show_tonegens(void) { // for debugging: dump tone generator status
                  tg->stopnote_pending ? ", stopnote pending\n" : "");
       else fprintf(fid, "#%d: idle\n", tgnum); } }
 
+// For -maxinstruments, see if starting this note would make too many different instruments sound
+// at once. If so, try to change it to a sounding instrument of the same General MIDI family
+// (the 128 instruments are in 16 families of 8), or return false if it must be skipped.
+bool instrument_limit_ok(struct noteinfo *np) {
+   bool sounding[128] = { false };
+   int num_sounding = 0;
+   bool anyidle = false;
+   if (np->note >= 128) return true; // translated percussion doesn't use instrument samples
+   for (int tgnum = 0; tgnum < num_tonegens; ++tgnum) {
+      struct tonegen_status *tg = &tonegen[tgnum];
+      if (!tg->playing) {
+         if (tgnum < num_tonegens - percussion_tonegens) anyidle = true; }
+      else if (tg->note.note < 128 && !sounding[tg->note.instrument]) {
+         sounding[tg->note.instrument] = true;
+         ++num_sounding; } }
+   if (!anyidle // it will be skipped anyway for lack of a generator
+         || sounding[np->instrument] || num_sounding < max_instruments) return true;
+   int family = np->instrument & ~7;
+   for (int instrument = family; instrument < family + 8; ++instrument)
+      if (sounding[instrument]) {
+         if (loggen) fprintf(logfile, "      instrument %d changed to %d because of -maxinstruments, %s\n",
+                                np->instrument, instrument, describe(np));
+         np->instrument = instrument;
+         ++instrument_limit_remaps;
+         return true; }
+   return false; }
+
+// get the range of tone generators a note may use, which -percussiongens restricts
+void tgen_range(struct noteinfo *np, int *first_tgen, int *end_tgen) {
+   *first_tgen = 0;
+   *end_tgen = num_tonegens;
+   if (percussion_tonegens) { // the last ones are reserved for percussion
+      if (np->note >= 128) *first_tgen = num_tonegens - percussion_tonegens;
+      else *end_tgen = num_tonegens - percussion_tonegens; } }
+
 // find an idle tone generator we can use
-int find_idle_tgen(struct noteinfo *np) { // returns -1 if there isn't one
+int find_idle_tgen(struct noteinfo *np) { // returns -1 if there isn't one, or -2 if -maxinstruments prevents it
    struct tonegen_status *tg;
    int tgnum;
    bool foundgen = false;
@@ -1009,27 +1797,30 @@ int find_idle_tgen(struct noteinfo *np) { // returns -1 if there isn't one
       tg = &tonegen[tgnum];
       if (tg->playing
             && tg->note.note == np->note && tg->note.channel == np->channel
-            && tg->note.track == np->track && tg->note.instrument == np->instrument) {
+            && tg->note.track == np->track && tg->requested_instrument == np->instrument) {
          // this must be the start of the sustain phase of a playing note
          ++playnotes_without_stopnotes;
          if (loggen) fprintf(logfile, "      *** playnote without stopnote, tgen %d, %s\n",
                                 tgnum, describe(np));
-         foundgen = true;
-         break; } }
+         np->instrument = tg->note.instrument; // keep any instrument change made by -maxinstruments
+         return tgnum; } }
+   if (max_instruments && !instrument_limit_ok(np)) return -2;
+   int first_tgen, end_tgen;
+   tgen_range(np, &first_tgen, &end_tgen);
    if (!foundgen && strategy2) { // try to use the same tone generator that this track used last time
       struct track_status *trk = &track[np->track];
       tg = &tonegen[trk->preferred_tonegen];
-      if (!tg->playing) {
+      if (!tg->playing && trk->preferred_tonegen >= first_tgen && trk->preferred_tonegen < end_tgen) {
          tgnum = trk->preferred_tonegen;
          foundgen = true; } }
    if (!foundgen)    // if not, then try for a free tone generator that had been playing the same instrument we need
-      for (tgnum = 0; tgnum < num_tonegens; ++tgnum) {
+      for (tgnum = first_tgen; tgnum < end_tgen; ++tgnum) {
          tg = &tonegen[tgnum];
          if (!tg->playing && tg->note.instrument == np->instrument) {
             foundgen = true;
             break; } }
    if (!foundgen)    // if not, then try for any free tone generator
-      for (tgnum = 0; tgnum < num_tonegens; ++tgnum) {
+      for (tgnum = first_tgen; tgnum < end_tgen; ++tgnum) {
          tg = &tonegen[tgnum];
          if (!tg->playing) {
             foundgen = true;
@@ -1037,8 +1828,160 @@ int find_idle_tgen(struct noteinfo *np) { // returns -1 if there isn't one
    if (foundgen) return tgnum;
    return -1; }
 
+// For -importance, find a tone generator playing a note less important than this one, which
+// we will stop so that this one can play instead. Returns -1 if there isn't one.
+int find_preemptable_tgen(struct noteinfo *np) {
+   int first_tgen, end_tgen, best_tgnum = -1;
+   tgen_range(np, &first_tgen, &end_tgen);
+   for (int tgnum = first_tgen; tgnum < end_tgen; ++tgnum) {
+      struct tonegen_status *tg = &tonegen[tgnum];
+      if (tg->playing && tg->note.importance < np->importance
+            && (best_tgnum < 0 || tg->note.importance < tonegen[best_tgnum].note.importance))
+         best_tgnum = tgnum; }
+   if (best_tgnum >= 0 && max_instruments) { // it mustn't make too many instruments sound
+      struct tonegen_status *tg = &tonegen[best_tgnum];
+      tg->playing = false;
+      if (!instrument_limit_ok(np)) {
+         tg->playing = true;
+         return -2; } }
+   return best_tgnum; }
+
+// start playing a note on a tone generator, and output the commands to do that
+void start_note(int tgnum, struct noteinfo *np, int requested_instrument) {
+   struct tonegen_status *tg = &tonegen[tgnum];
+   if (tgnum + 1 > num_tonegens_used) num_tonegens_used = tgnum + 1;
+   if (tg->note.instrument != np->instrument) { // it's a new instrument for this generator
+      tg->note.instrument = np->instrument;
+      ++instrument_changes;
+      if (loggen) fprintf(logfile, "      tgen %d changed to instrument %d\n", tgnum, tg->note.instrument);
+      if (make_map && instrumentoutput) map_command(EVENT_INSTRUMENT, np, 2);
+      output_instrument(tgnum, tg->note.instrument); }
+   if (loggen) fprintf(logfile, "      play tgen %d %s\n", tgnum, describe(np));
+   tg->playing = true;
+   tg->stopnote_pending = false; // don't bother to issue "stop note"
+   tg->note = *np;  // structure copy of note info
+   tg->requested_instrument = requested_instrument;
+   tg->started_late = false;
+   track[tg->note.track].preferred_tonegen = tgnum;
+   ++note_on_commands;
+   last_output_was_delay = false;
+   if (make_map) map_command(np->kind, np, volume_output ? 3 : 2);
+   output_play(tgnum, tg->note.note, tg->note.volume); }
+
+/* For -recover, we remember notes that were skipped because there wasn't a free tone generator
+until their "stop note" is dequeued. If a generator becomes free before then, we start the most
+important of them late, which is usually better than not playing it at all. */
+
+#define MAX_PENDING 32          // how many skipped notes we remember
+#define RECOVER_MIN_USEC 20000  // don't start a skipped note late if it would play for less than this
+struct noteinfo pending_notes[MAX_PENDING];
+int num_pending = 0;
+
+bool same_note(struct noteinfo *np1, struct noteinfo *np2) {
+   return np1->note == np2->note && np1->channel == np2->channel && np1->track == np2->track; }
+
+void add_pending_note(struct noteinfo *np) {
+   int ndx, least_ndx = 0;
+   for (ndx = 0; ndx < num_pending; ++ndx) {
+      if (same_note(&pending_notes[ndx], np)) break; // a sustain phase replaces the original
+      if (pending_notes[ndx].importance < pending_notes[least_ndx].importance) least_ndx = ndx; }
+   if (ndx >= num_pending) { // not there yet
+      if (num_pending < MAX_PENDING) ndx = num_pending++;
+      else if (pending_notes[least_ndx].importance < np->importance) ndx = least_ndx;
+      else return; }
+   pending_notes[ndx] = *np; }
+
+void remove_pending_note(struct noteinfo *np) {
+   for (int ndx = 0; ndx < num_pending; ++ndx)
+      if (same_note(&pending_notes[ndx], np)) {
+         pending_notes[ndx] = pending_notes[--num_pending];
+         return; } }
+
+// is the "stop note" for a pending note already in the queue too soon for it to be worth starting?
+bool pending_note_ends_soon(struct noteinfo *np) {
+   if (queue_numitems > 0) for (int ndx = queue_oldest_ndx;;) {
+         struct queue_entry *q = &queue[ndx];
+         if (q->cmd == CMD_STOPNOTE && same_note(&q->note, np))
+            return q->note.time_usec < output_usec + RECOVER_MIN_USEC;
+         if (ndx == queue_newest_ndx) break;
+         if (++ndx >= queue_size) ndx = 0; }
+   return false; }
+
+// start pending notes late on any tone generators that are now free
+void recover_pending_notes(void) {
+   bool too_many_instruments[MAX_PENDING] = { false }; // pending notes -maxinstruments won't let start now
+   for (int tgnum = 0; tgnum < num_tonegens && num_pending > 0; ++tgnum) {
+      if (tonegen[tgnum].playing) continue;
+      int best_ndx = -1;
+      for (int ndx = 0; ndx < num_pending; ++ndx) {
+         struct noteinfo *np = &pending_notes[ndx];
+         int first_tgen, end_tgen;
+         tgen_range(np, &first_tgen, &end_tgen);
+         if (tgnum >= first_tgen && tgnum < end_tgen && !too_many_instruments[ndx]
+               && (best_ndx < 0 || np->importance > pending_notes[best_ndx].importance)
+               && !pending_note_ends_soon(np))
+            best_ndx = ndx; }
+      if (best_ndx >= 0) {
+         struct noteinfo note = pending_notes[best_ndx];
+         int requested_instrument = note.instrument;
+         if (max_instruments && !instrument_limit_ok(&note)) { // leave it pending until another instrument stops
+            too_many_instruments[best_ndx] = true;
+            --tgnum; // and try the next best one on this generator
+            continue; }
+         pending_notes[best_ndx] = pending_notes[--num_pending];
+         too_many_instruments[best_ndx] = too_many_instruments[num_pending];
+         if (loggen) fprintf(logfile, "      starting skipped note late on tgen %d %s\n", tgnum, describe(&note));
+         if (showskipped) printf("  *** started late at %lu.%03lu msec, %s\n",
+                                    (unsigned long)(output_usec / 1000), (unsigned long)(output_usec % 1000), describe(&note));
+         start_note(tgnum, &note, requested_instrument);
+         tonegen[tgnum].started_late = true;
+         ++notes_recovered; } } }
+
+// A note that was started late gives way to a note that is starting on time, and becomes pending again.
+int find_late_tgen(struct noteinfo *np) { // returns -1 if there isn't one, or -2 if -maxinstruments prevents it
+   int first_tgen, end_tgen;
+   tgen_range(np, &first_tgen, &end_tgen);
+   for (int tgnum = first_tgen; tgnum < end_tgen; ++tgnum) {
+      struct tonegen_status *tg = &tonegen[tgnum];
+      if (tg->playing && tg->started_late) {
+         tg->playing = false;
+         if (max_instruments && !instrument_limit_ok(np)) { // it mustn't make too many instruments sound
+            tg->playing = true;
+            return -2; }
+         if (loggen) fprintf(logfile, "      late note on tgen %d gives way, %s\n", tgnum, describe(&tg->note));
+         struct noteinfo note = tg->note;
+         note.instrument = tg->requested_instrument;
+         add_pending_note(&note);
+         return tgnum; } }
+   return -1; }
+
+struct sounding_notes { // for reporting how many tone generators -consolidate saved at the peak
+   int count, peak;
+   int num_channels;            // how many channels there is room for in "playing"
+   uint16_t *playing;           // for each channel and note, how many tracks are sounding it
+} sounding_all, sounding_kept;
+
+// keep track of how many notes would be sounding with and without the ones -consolidate removed
+void count_sounding(int cmd, struct noteinfo *np, bool deleted) {
+   for (int pass = deleted ? 1 : 0; pass < 2; ++pass) {
+      struct sounding_notes *sp = pass == 0 ? &sounding_kept : &sounding_all;
+      if (np->channel >= sp->num_channels) { // make room for the channels there are now
+         sp->playing = (uint16_t *) arena_grow(sp->playing, sp->num_channels * 256 * sizeof(uint16_t),
+                                               num_channels * 256 * sizeof(uint16_t));
+         if (!sp->playing) out_of_memory("channels", num_channels);
+         for (int ndx = sp->num_channels * 256; ndx < num_channels * 256; ++ndx) sp->playing[ndx] = 0;
+         sp->num_channels = num_channels; }
+      uint16_t *playing = &sp->playing[np->channel * 256 + np->note];
+      if (cmd == CMD_PLAYNOTE && np->kind != EVENT_SUSTAIN) {
+         ++*playing;
+         if (++sp->count > sp->peak) sp->peak = sp->count; }
+      else if (cmd == CMD_STOPNOTE && *playing) {
+         --*playing;
+         --sp->count; } } }
+
 void remove_queue_entry(int ndx) { // remove the oldest queue entry
    struct queue_entry *q = &queue[ndx];
+   if (consolidate_usec) count_sounding(q->cmd, &q->note, q->delete);
    if (q->delete) return; // if marked for deletion, just ignore it
    if (q->cmd == CMD_STOPNOTE) {
       if (loggen) fprintf(logfile, "      dequeue stopnote for %s\n", describe(&q->note));
@@ -1052,59 +1995,46 @@ void remove_queue_entry(int ndx) { // remove the oldest queue entry
             tg->stopnote_pending = true; // "stop note needed unless another start note follows"
             tg->playing = false; // free the tg to be reallocated, but note the stop time in case
             tg->note.time_usec = q->note.time_usec;  // the tg doesn't get used and we generate it
+            tg->note.tick = q->note.tick;            //   (and what caused it, for -map)
+            tg->note.kind = q->note.kind;
             if (loggen) fprintf(logfile, "      pending stop tgen %d %s\n", tgnum, describe(&q->note));
             break; } }
       if (tgnum >= num_tonegens) {
          // If we exited the loop without finding the generator playing this note, presumably it never started
          // because there weren't any free tone generators. Is there some assertion we can use to verify that?
          ++stopnotes_without_playnotes;
-         if (loggen) fprintf(logfile, "      *** stopnote without playnote, %s\n", describe(&q->note)); } }
+         if (loggen) fprintf(logfile, "      *** stopnote without playnote, %s\n", describe(&q->note)); }
+      if (recover_notes) remove_pending_note(&q->note); }
 
    else { // CMD_PLAYNOTE
       assert(q->cmd == CMD_PLAYNOTE, "bad cmd in remove_queue_entry");
       if (loggen) fprintf(logfile, "      dequeue playnote for %s\n", describe(&q->note));
+      int requested_instrument = q->note.instrument;
       int tgnum = find_idle_tgen(&q->note);
-      struct tonegen_status *tg = &tonegen[tgnum];
+      if (tgnum == -1 && recover_notes) tgnum = find_late_tgen(&q->note);
+      if (tgnum == -1 && preempt_notes // no free generator, but maybe we can stop a less important note
+            && (tgnum = find_preemptable_tgen(&q->note)) >= 0) {
+         struct tonegen_status *tg = &tonegen[tgnum];
+         if (loggen) fprintf(logfile, "  *** at %lu.%03lu msec tgen %d stopped for a more important note; importance %d %s\n",
+                                (unsigned long)(output_usec / 1000), (unsigned long)(output_usec % 1000), tgnum, tg->note.importance, describe(&tg->note));
+         if (showskipped) printf("  *** stopped for a more important note, importance %d %s\n",
+                                    tg->note.importance, describe(&tg->note));
+         ++notes_preempted; }
       if (tgnum >= 0) { // we found a tone generator we can use
-         if (tgnum + 1 > num_tonegens_used) num_tonegens_used = tgnum + 1;
-         if (tg->note.instrument != q->note.instrument) { // it's a new instrument for this generator
-            tg->note.instrument = q->note.instrument;
-            ++instrument_changes;
-            if (loggen) fprintf(logfile, "      tgen %d changed to instrument %d\n", tgnum, tg->note.instrument);
-            if (instrumentoutput) { // output a "change instrument" command
-               if (binaryoutput) {
-                  putc(CMD_INSTRUMENT | tgnum, outfile);
-                  putc(tg->note.instrument, outfile);
-                  outfile_bytecount += 2; }
-               else {
-                  fprintf(outfile, "0x%02X,%d, ", CMD_INSTRUMENT | tgnum, tg->note.instrument);
-                  outfile_items(2); } } }
-         if (loggen) fprintf(logfile, "      play tgen %d %s\n", tgnum, describe(&q->note));
-         tg->playing = true;
-         tg->stopnote_pending = false; // don't bother to issue "stop note"
-         tg->note = q->note;  // structure copy of note info
-         track[tg->note.track].preferred_tonegen = tgnum;
-         ++note_on_commands;
-         last_output_was_delay = false;
-         if (binaryoutput) {
-            putc(CMD_PLAYNOTE | tgnum, outfile);
-            putc(tg->note.note, outfile);
-            outfile_bytecount += 2;
-            if (volume_output) {
-               putc(tg->note.volume, outfile);
-               outfile_bytecount +=1; } }
-         else {
-            if (volume_output == 0) {
-               fprintf(outfile, "0x%02X,%d, ", CMD_PLAYNOTE | tgnum, tg->note.note);
-               outfile_items(2); }
-            else {
-               fprintf(outfile, "0x%02X,%d,%d, ", CMD_PLAYNOTE | tgnum, tg->note.note, tg->note.volume);
-               outfile_items(3); } } }
+         start_note(tgnum, &q->note, requested_instrument);
+         if (recover_notes) remove_pending_note(&q->note); } // it might be a sustain phase of a skipped note
+      else if (tgnum == -2) {
+         ++instrument_limit_drops;
+         if (loggen) fprintf(logfile, "  *** at %lu.%03lu msec too many instruments; skipping %s\n",
+                                (unsigned long)(output_usec / 1000), (unsigned long)(output_usec % 1000), describe(&q->note));
+         if (showskipped) printf("  *** too many instruments, importance %d %s\n",
+                                    q->note.importance, describe(&q->note)); }
       else {
          if (loggen) fprintf(logfile, "  *** at %lu.%03lu msec no free generator; skipping %s\n",
                                 output_usec / 1000, output_usec % 1000, describe(&q->note));
-         if (showskipped) printf("  *** no free generator %s\n",
-                                    describe(&q->note)); ++notes_skipped; } } }
+         if (showskipped) printf("  *** no free generator, importance %d %s\n",
+                                    q->note.importance, describe(&q->note)); ++notes_skipped;
+         if (recover_notes) add_pending_note(&q->note); } } }
 
 void generate_delay(unsigned long delta_msec) { // output a delay command
    if (delta_msec > 0) {
@@ -1113,13 +2043,8 @@ void generate_delay(unsigned long delta_msec) { // output a delay command
          ++consecutive_delays;
          if (loggen) fprintf(logfile, "      *** this is a consecutive delay, of %d msec\n", delta_msec); }
       last_output_was_delay = true;
-      if (binaryoutput) { // output a 15-bit delay in big-endian format
-         putc((byte)(delta_msec >> 8), outfile);
-         putc((byte)(delta_msec & 0xff), outfile);
-         outfile_bytecount += 2; }
-      else {
-         fprintf(outfile, "%ld,%ld, ", delta_msec >> 8, delta_msec & 0xff);
-         outfile_items(2); } } }
+      map_offset += 2;
+      output_delay(delta_msec); } }
 
 // output all queue elements which are at the oldest time or at most "delaymin" later
 void pull_queue(void) {
@@ -1143,21 +2068,19 @@ void pull_queue(void) {
    do {  // output and remove all entries at the same (oldest) time in the queue
       // or which are only delaymin newer
       remove_queue_entry(queue_oldest_ndx);
-      if (++queue_oldest_ndx >= QUEUE_SIZE) queue_oldest_ndx = 0;
+      if (++queue_oldest_ndx >= queue_size) queue_oldest_ndx = 0;
       --queue_numitems; }
    while (queue_numitems > 0 && queue[queue_oldest_ndx].note.time_usec <= oldtime + (timestamp)delaymin_usec);
 
+   if (recover_notes) recover_pending_notes(); // maybe start skipped notes on generators that were freed
+
    // do any "stop notes" still need to be generated?
    for (int tgnum = 0; tgnum < num_tonegens; ++tgnum) {
       struct tonegen_status *tg = &tonegen[tgnum];
       if (tg->stopnote_pending) { // got one
          last_output_was_delay = false;
-         if (binaryoutput) {
-            putc(CMD_STOPNOTE | tgnum, outfile);
-            outfile_bytecount += 1; }
-         else {
-            fprintf(outfile, "0x%02X, ", CMD_STOPNOTE | tgnum);
-            outfile_items(1); }
+         if (make_map) map_command(EVENT_STOP, &tg->note, 1);
+         output_stop(tgnum);
          if (loggen) fprintf(logfile, "      stop tgen %d %s\n", tgnum, describe(&tg->note));
          tg->stopnote_pending = false;
          tg->playing = false; } } }
@@ -1179,7 +2102,7 @@ int queue_find_playnote(int search_ndx) {
          if (loggen) fprintf(logfile, "found ndx %d\n", ndx);
          return ndx; }
       if (ndx == queue_oldest_ndx) break;
-      if (--ndx < 0) ndx = QUEUE_SIZE - 1; }
+      if (--ndx < 0) ndx = queue_size - 1; }
    if (loggen) fprintf(logfile, "not found\n");
    return -1; }
 
@@ -1196,7 +2119,7 @@ int queue_find_stopnote(int search_ndx) {
          if (loggen) fprintf(logfile, "found ndx %d\n", ndx);
          return ndx; }
       if (ndx == queue_oldest_ndx) break;
-      if (--ndx < 0) ndx = QUEUE_SIZE - 1; }
+      if (--ndx < 0) ndx = queue_size - 1; }
    if (loggen) fprintf(logfile, "not found\n");
    return -1; }
 
@@ -1210,13 +2133,184 @@ void remove_queue_duplicates(int stop_ndx) {
       if (loggen) fprintf(logfile, "    remove duplicate, ndxs %d, %d: %s\n", dup_play_ndx, dup_stop_ndx, describe(&queue[dup_play_ndx].note));
       queue[dup_play_ndx].delete = queue[dup_stop_ndx].delete = true; } }
 
+/* For -consolidate, remove notes that sound almost the same as another note: they start and stop
+within a tolerance of each other, and are for the same note on the same instrument. -octavefold
+also matches notes whole octaves apart, and -anyinstrument matches notes on any instrument.
+Orchestral scores are full of those, and they use up tone generators. Of the two, we keep the
+more important one. We can only do this while both notes are still in the queue. */
+
+bool timeclose(timestamp t1, timestamp t2) {
+   return (t1 > t2 ? t1 - t2 : t2 - t1) <= consolidate_usec; }
+
+bool notes_consolidatable(struct noteinfo *np1, struct noteinfo *np2) {
+   if (!any_instrument && np1->instrument != np2->instrument) return false;
+   if (np1->note == np2->note) return true;
+   return octave_fold && np1->note < 128 && np2->note < 128 // not percussion
+          && (np1->note - np2->note) % 12 == 0; }
+
+// find the newest queued play for the note stopped by queue[stop_ndx], or -1
+int queue_find_play_of(int stop_ndx) {
+   struct noteinfo *np = &queue[stop_ndx].note;
+   for (int ndx = stop_ndx;;) {
+      if (!queue[ndx].delete && queue[ndx].cmd == CMD_PLAYNOTE && same_note(&queue[ndx].note, np))
+         return ndx;
+      if (ndx != stop_ndx && queue[ndx].cmd == CMD_STOPNOTE && same_note(&queue[ndx].note, np))
+         break; // that's the end of an earlier note of the same pitch
+      if (ndx == queue_oldest_ndx) break;
+      if (--ndx < 0) ndx = queue_size - 1; }
+   return -1; }
+
+bool note_is_playing(struct noteinfo *np) {
+   for (int tgnum = 0; tgnum < num_tonegens; ++tgnum)
+      if (tonegen[tgnum].playing && same_note(&tonegen[tgnum].note, np)) return true;
+   return false; }
+
+// delete the stop in queue[stop_ndx], and the play and sustain phase of that note before it
+void queue_delete_note(int stop_ndx) {
+   struct noteinfo *np = &queue[stop_ndx].note;
+   if (loggen) fprintf(logfile, "    consolidate note, ndx %d: %s\n", stop_ndx, describe(np));
+   queue[stop_ndx].delete = true;
+   for (int ndx = stop_ndx;;) {
+      if (ndx != stop_ndx && queue[ndx].cmd == CMD_STOPNOTE && same_note(&queue[ndx].note, np))
+         break; // the plays before this belong to an earlier note of the same pitch
+      if (queue[ndx].cmd == CMD_PLAYNOTE && same_note(&queue[ndx].note, np))
+         queue[ndx].delete = true;
+      if (ndx == queue_oldest_ndx) break;
+      if (--ndx < 0) ndx = queue_size - 1; }
+   ++notes_consolidated; }
+
+void consolidate_queue_notes(int stop_ndx) {
+   int play_ndx = queue_find_play_of(stop_ndx);
+   if (play_ndx < 0 || note_is_playing(&queue[stop_ndx].note)) return; // too late to do anything
+   for (int ndx = queue_oldest_ndx;;) {
+      struct queue_entry *q = &queue[ndx];
+      int other_play_ndx;
+      if (ndx != stop_ndx && !q->delete && q->cmd == CMD_STOPNOTE
+            && !same_note(&q->note, &queue[stop_ndx].note)
+            && timeclose(q->note.time_usec, queue[stop_ndx].note.time_usec)
+            && notes_consolidatable(&q->note, &queue[stop_ndx].note)
+            && (other_play_ndx = queue_find_play_of(ndx)) >= 0
+            && timeclose(queue[other_play_ndx].note.time_usec, queue[play_ndx].note.time_usec)
+            && !note_is_playing(&q->note)) { // found one: remove the less important of the two
+         queue_delete_note(queue[other_play_ndx].note.importance < queue[play_ndx].note.importance ? ndx : stop_ndx);
+         return; }
+      if (ndx == queue_newest_ndx) break;
+      if (++ndx >= queue_size) ndx = 0; } }
+
+/************  exporting the queued events  *****************/
+
+/* With -events, we record each play and stop event as it is queued, which is after the tracks
+   are merged, the tempo is applied, the notes are shifted or translated, and the sustain and
+   release times are computed, but before any tone generators are assigned. At the end we
+   write them in columns to <basefilename>.events; the format is described with the -events
+   option. -readevents turns such a file into CSV. */
+
+#define EVENTS_VERSION 1
+#define EVENTS_COLUMNS 7
+#define EVENTS_HEADER_SIZE 12
+#define EVENTS_BYTES_EACH 12   // the total of the column widths
+struct exported_event {
+   timestamp time_usec;
+   uint16_t track, channel;
+   byte note, instrument, volume, kind; } *exported_events = NULL;
+unsigned long num_exported_events = 0, exported_events_room = 0;
+
+void export_event(struct noteinfo *np) {
+   if (num_exported_events >= exported_events_room) { // make room for more: double it
+      unsigned long room = exported_events_room ? 2 * exported_events_room : 4096;
+      exported_events = (struct exported_event *) arena_grow(exported_events,
+                        exported_events_room * sizeof(struct exported_event), room * sizeof(struct exported_event));
+      if (!exported_events) out_of_memory("events", room);
+      exported_events_room = room; }
+   struct exported_event *ep = &exported_events[num_exported_events++];
+   ep->time_usec = np->time_usec;
+   ep->track = np->track;
+   ep->channel = np->channel;
+   ep->note = np->note;
+   ep->instrument = np->instrument;
+   ep->volume = np->volume;
+   ep->kind = np->kind; }
+
+unsigned long get_little_endian(const byte *ptr, int bytes) {
+   unsigned long val = 0;
+   for (int i = bytes - 1; i >= 0; --i) val = (val << 8) | ptr[i];
+   return val; }
+
+bool write_events(const char *filebasename) { // returns false if we couldn't
+   char filename[MAXPATH];
+   miditones_strlcpy (filename, filebasename, MAXPATH);
+   miditones_strlcat (filename, ".events", MAXPATH);
+   FILE *file = fopen(filename, "wb");
+   if (!file) {
+      fprintf (stderr, "Unable to open events file %s\n", filename);
+      return false; }
+   fwrite("MTev", 1, 4, file);
+   put_little_endian(file, EVENTS_VERSION, 2);
+   put_little_endian(file, EVENTS_COLUMNS, 2);
+   put_little_endian(file, num_exported_events, 4);
+   struct exported_event *ep, *end = exported_events + num_exported_events;
+   for (ep = exported_events; ep < end; ++ep) put_little_endian(file, ep->time_usec, 4);
+   for (ep = exported_events; ep < end; ++ep) put_little_endian(file, ep->track, 2);
+   for (ep = exported_events; ep < end; ++ep) put_little_endian(file, ep->channel, 2);
+   for (ep = exported_events; ep < end; ++ep) putc(ep->note, file);
+   for (ep = exported_events; ep < end; ++ep) putc(ep->instrument, file);
+   for (ep = exported_events; ep < end; ++ep) putc(ep->volume, file);
+   for (ep = exported_events; ep < end; ++ep) putc(ep->kind, file);
+   bool ok = !ferror(file);
+   if (fclose(file) != 0) ok = false;
+   if (!ok) fprintf(stderr, "Unable to write events file %s\n", filename);
+   else printf("  %lu play and stop events were written to %s\n", num_exported_events, filename);
+   return ok; }
+
+int read_events(const char *filename) { // copy an events file to <filename>.csv; returns 0 if successful
+   FILE *file = fopen(filename, "rb");
+   if (!file) {
+      fprintf(stderr, "Unable to open events file %s\n", filename);
+      return 1; }
+   fseek (file, 0, SEEK_END);
+   long length = ftell (file);
+   fseek (file, 0, SEEK_SET);
+   byte *data = (byte *) arena_alloc (length > 0 ? length : 1);
+   if (!data || fread(data, 1, length, file) != length) {
+      fprintf(stderr, "Unable to read events file %s\n", filename);
+      fclose(file);
+      return 1; }
+   fclose(file);
+   unsigned long count = length >= EVENTS_HEADER_SIZE ? get_little_endian(data + 8, 4) : 0;
+   if (length < EVENTS_HEADER_SIZE || !charcmp((char *) data, "MTev")
+         || get_little_endian(data + 4, 2) != EVENTS_VERSION
+         || get_little_endian(data + 6, 2) != EVENTS_COLUMNS
+         || (unsigned long)(length - EVENTS_HEADER_SIZE) != count * EVENTS_BYTES_EACH) {
+      fprintf(stderr, "%s is not a version %d events file\n", filename, EVENTS_VERSION);
+      return 1; }
+   char csvname[MAXPATH];
+   miditones_strlcpy(csvname, filename, MAXPATH);
+   miditones_strlcat(csvname, ".csv", MAXPATH);
+   FILE *csv = fopen(csvname, "w");
+   if (!csv) {
+      fprintf(stderr, "Unable to open CSV file %s\n", csvname);
+      return 1; }
+   byte *time_usec = data + EVENTS_HEADER_SIZE, *track = time_usec + 4 * count,
+         *channel = track + 2 * count, *note = channel + 2 * count, *instrument = note + count,
+         *volume = instrument + count, *kind = volume + count;
+   fprintf(csv, "time_usec,track,channel,note,instrument,volume,kind\n");
+   for (unsigned long i = 0; i < count; ++i)
+      fprintf(csv, "%lu,%lu,%lu,%d,%d,%d,%s\n", get_little_endian(time_usec + 4 * i, 4),
+             get_little_endian(track + 2 * i, 2), get_little_endian(channel + 2 * i, 2),
+             note[i], instrument[i], volume[i], kind[i] <= EVENT_INSTRUMENT ? event_kind_names[kind[i]] : "?");
+   if (fclose(csv) != 0) {
+      fprintf(stderr, "Unable to write CSV file %s\n", csvname);
+      return 1; }
+   printf("%lu events were written to %s\n", count, csvname);
+   return 0; }
+
 // queue a "note on" or "note off" command
 void queue_cmd(byte cmd, struct noteinfo *np) {
    if (loggen) fprintf(logfile, "  queue %s %s\n",
                           cmd == CMD_PLAYNOTE ? "PLAY" : cmd == CMD_STOPNOTE ? "STOP" : "????",
                           describe(np));
-   if (queue_numitems >= QUEUE_SIZE) pull_queue();
-   assert(queue_numitems < QUEUE_SIZE, "no room in queue");
+   if (queue_numitems >= queue_size) pull_queue();
+   assert(queue_numitems < queue_size, "no room in queue");
    timestamp horizon = output_usec + output_deficit_usec;
    if (np->time_usec < horizon) { // don't allow revisionist history
       if (loggen) fprintf(logfile, "  event delayed by %lu usec because queue is too small\n",
@@ -1231,26 +2325,64 @@ void queue_cmd(byte cmd, struct noteinfo *np) {
       ndx = queue_newest_ndx; // start with newest, since we are most often newer
       while (queue[ndx].note.time_usec > np->time_usec) { // search backwards for something as new or older
          if (ndx == queue_oldest_ndx) { // none: we are oldest; add to the start
-            if (--queue_oldest_ndx < 0) queue_oldest_ndx = QUEUE_SIZE - 1;
+            if (--queue_oldest_ndx < 0) queue_oldest_ndx = queue_size - 1;
             ndx = queue_oldest_ndx;
             goto insert; }
-         if (--ndx < 0) ndx = QUEUE_SIZE - 1; }
+         if (--ndx < 0) ndx = queue_size - 1; }
       // we are to insert the new item after "ndx", so shift all later entries down, if any
       int from_ndx, to_ndx;
-      if (++queue_newest_ndx >= QUEUE_SIZE) queue_newest_ndx = 0;
+      if (++queue_newest_ndx >= queue_size) queue_newest_ndx = 0;
       to_ndx = queue_newest_ndx;
       while (1) {
-         if ((from_ndx = to_ndx - 1) < 0) from_ndx = QUEUE_SIZE - 1;
+         if ((from_ndx = to_ndx - 1) < 0) from_ndx = queue_size - 1;
          if (from_ndx == ndx) break;
          queue[to_ndx] = queue[from_ndx]; // structure copy
          to_ndx = from_ndx; }
-      if (++ndx >= QUEUE_SIZE) ndx = 0; }
+      if (++ndx >= queue_size) ndx = 0; }
 insert: // store the item at ndx
    ++queue_numitems;
    queue[ndx].cmd = cmd;   // fill in the queue entry
    queue[ndx].delete = false;
    queue[ndx].note = *np;  // structure copy of the note
-   if (noduplicates && cmd == CMD_STOPNOTE) remove_queue_duplicates(ndx); }
+   if (noduplicates && cmd == CMD_STOPNOTE) remove_queue_duplicates(ndx);
+   if (consolidate_usec && cmd == CMD_STOPNOTE) consolidate_queue_notes(ndx); }
+
+/* For -percussionmax, remove the stop we queued when the note started, if it hasn't been output
+   yet. We take it out of the queue instead of marking it deleted, because a deleted entry still
+   moves the output time to its own time when it is pulled, and this one may be far in the future. */
+bool queue_remove_percussion_stop(struct noteinfo *np, timestamp stop_usec) { // returns false if it was output
+   if (queue_numitems > 0) for (int ndx = queue_oldest_ndx;;) {
+         struct queue_entry *q = &queue[ndx];
+         if (!q->delete && q->cmd == CMD_STOPNOTE && same_note(&q->note, np)
+               && q->note.time_usec >= stop_usec) { // it may have been delayed, but not moved earlier
+            while (ndx != queue_newest_ndx) { // move the later entries up
+               int next_ndx = ndx + 1 < queue_size ? ndx + 1 : 0;
+               queue[ndx] = queue[next_ndx]; // structure copy
+               ndx = next_ndx; }
+            if (--queue_newest_ndx < 0) queue_newest_ndx = queue_size - 1;
+            --queue_numitems;
+            return true; }
+         if (ndx == queue_newest_ndx) break;
+         if (++ndx >= queue_size) ndx = 0; }
+   return false; }
+
+// Now that we know how long a note is, add to its importance. It may already be playing on a tone
+// generator, and its "play" commands may still be in the queue.
+void add_importance(struct noteinfo *np, int increment) {
+   np->importance += increment;
+   for (int tgnum = 0; tgnum < num_tonegens; ++tgnum) {
+      struct tonegen_status *tg = &tonegen[tgnum];
+      if (tg->playing && tg->note.note == np->note && tg->note.channel == np->channel
+            && tg->note.track == np->track)
+         tg->note.importance += increment; }
+   if (queue_numitems > 0) for (int ndx = queue_newest_ndx;;) { // newest first, back to the note's start
+         struct queue_entry *q = &queue[ndx];
+         if (q->note.time_usec < np->time_usec) break; // the queue is in time order
+         if (q->cmd == CMD_PLAYNOTE && q->note.note == np->note && q->note.channel == np->channel
+               && q->note.track == np->track)
+            q->note.importance += increment;
+         if (ndx == queue_oldest_ndx) break;
+         if (--ndx < 0) ndx = queue_size - 1; } }
 
 void show_queue_cmd(timestamp time_usec, byte cmd, int note) {
    printf("debug queue %s note %02X at %6ld\n", cmd == CMD_PLAYNOTE ? "PLAY" : "STOP", note, time_usec);
@@ -1261,9 +2393,79 @@ void show_queue_cmd(timestamp time_usec, byte cmd, int note) {
    notedata.note = note;
    notedata.instrument = 1;
    notedata.volume = 100;
+   notedata.importance = 0;
+   notedata.kind = cmd == CMD_PLAYNOTE ? EVENT_PLAY : EVENT_STOP;
+   notedata.tick = 0;
    queue_cmd(cmd, &notedata);
    show_queue(); }
 
+unsigned long get_varlen (uint8_t ** ptr) { // get a MIDI-style integer
+   /* Get a 1-4 byte variable-length value and adjust the pointer past it.
+   These are a succession of 7-bit values with a MSB bit of zero marking the end */
+   unsigned long val = 0;
+   for (int i = 0; i < 4; ++i) {
+      byte b = *(*ptr)++;
+      val = (val << 7) | (b & 0x7f);
+      if (!(b & 0x80))
+         return val; }
+   return val; }
+
+/* Before we parse a track, check once that every event in it fits inside the track.
+   After that, find_next_note can read the events without checking each byte. */
+
+void track_error(int tracknum, char *msg, byte *ptr) {
+   static char message[100];
+   sprintf(message, "track %d: %.80s", tracknum, msg);
+   midi_error(message, ptr); }
+
+unsigned long check_varlen(int tracknum, byte **ptr, byte *end) { // get_varlen, but checked
+   byte *start = *ptr;
+   for (int i = 0; i < 4; ++i) {
+      if (start + i >= end) track_error(tracknum, "variable-length number runs past the end of the track", start);
+      if (!(start[i] & 0x80)) return get_varlen(ptr); }
+   track_error(tracknum, "variable-length number is longer than 4 bytes", start);
+   return 0; }
+
+void validate_track(int tracknum) {
+   byte *ptr = track[tracknum].trkstart, *end = track[tracknum].trkend;
+   byte last_event = 0;
+   while (ptr < end) {
+      check_varlen(tracknum, &ptr, end); // the delta time
+      if (ptr >= end) track_error(tracknum, "event missing after the delta time", ptr);
+      byte *event_ptr = ptr;
+      int event = *ptr < 0x80 ? last_event : *ptr++;
+      if (event < 0x80) track_error(tracknum, "running status without a previous event", event_ptr);
+      if (event == 0xff) { // meta-event
+         if (ptr >= end) track_error(tracknum, "meta-event type missing", event_ptr);
+         int meta_cmd = *ptr++;
+         unsigned long meta_length = check_varlen(tracknum, &ptr, end);
+         if (meta_length > (unsigned long)(end - ptr))
+            track_error(tracknum, "meta-event runs past the end of the track", event_ptr);
+         static const struct { // the meta-events find_next_note reads data from
+            byte cmd, minlength; } meta_minimums[] = {
+            {0x00, 2}, {0x20, 1}, {0x21, 1}, {0x51, 3}, {0x54, 4}, {0x58, 4}, {0x59, 2} };
+         for (int i = 0; i < sizeof(meta_minimums) / sizeof(meta_minimums[0]); ++i)
+            if (meta_cmd == meta_minimums[i].cmd && meta_length < meta_minimums[i].minlength)
+               track_error(tracknum, "meta-event is too short", event_ptr);
+         ptr += meta_length; }
+      else {
+         if (event < 0xf0) last_event = event;
+         switch (event >> 4) {
+         case 0x8: case 0x9: case 0xa: case 0xb: case 0xe: // two data bytes
+            if (end - ptr < 2) track_error(tracknum, "channel event runs past the end of the track", event_ptr);
+            ptr += 2;
+            break;
+         case 0xc: case 0xd: // one data byte
+            if (end - ptr < 1) track_error(tracknum, "channel event runs past the end of the track", event_ptr);
+            ptr += 1;
+            break;
+         case 0xf: { // sysex event
+            unsigned long sysex_length = check_varlen(tracknum, &ptr, end);
+            if (sysex_length > (unsigned long)(end - ptr))
+               track_error(tracknum, "sysex event runs past the end of the track", event_ptr);
+            ptr += sysex_length;
+            break; } } } } }
+
 /**************  process the MIDI file header  *****************/
 
 void process_file_header (void) {
@@ -1275,6 +2477,7 @@ void process_file_header (void) {
    if (!charcmp ((char *) hdr->MThd, "MThd"))
       midi_error ("Missing 'MThd'", hdrptr);
    num_tracks = rev_short (hdr->number_of_tracks);
+   format_type = rev_short (hdr->format_type);
    time_division = rev_short (hdr->time_division);
    if (time_division < 0x8000)
       ticks_per_beat = time_division;
@@ -1301,24 +2504,53 @@ void process_track_header (int tracknum) {
    if (logparse) fprintf (logfile, "\nTrack %d length %ld\n", tracknum, tracklen);
    hdrptr += sizeof (struct track_header);      /* point past header */
    chk_bufdata (hdrptr, tracklen);
-   track[tracknum].trkptr = hdrptr;
+   track[tracknum].trkptr = track[tracknum].trkstart = hdrptr;
    hdrptr += tracklen;          /* point to the start of the next track */
    track[tracknum].trkend = hdrptr;     /* the point past the end of the track */
+   validate_track(tracknum);
 }
 
-unsigned long get_varlen (uint8_t ** ptr) { // get a MIDI-style integer
-   /* Get a 1-4 byte variable-length value and adjust the pointer past it.
-   These are a succession of 7-bit values with a MSB bit of zero marking the end */
-   unsigned long val = 0;
-   for (int i = 0; i < 4; ++i) {
-      byte b = *(*ptr)++;
-      val = (val << 7) | (b & 0x7f);
-      if (!(b & 0x80))
-         return val; }
-   return val; }
-
 /***************  Process the MIDI track data  ***************************/
 
+/* When we aren't logging, skip quickly over a run of the events we ignore: key pressure,
+   controller changes, channel pressure, pitch bends and sysex. Files with a lot of controller
+   automation are mostly those. We stop at anything else, including note, program change and
+   meta-events, which find_next_note handles. The track has been validated, so we don't need
+   to check that the events fit. */
+
+void skip_ignored_events(struct track_status *t) {
+   byte *ptr = t->trkptr, *end = t->trkend;
+   unsigned long time = t->time;
+   byte last_event = t->last_event;
+   while (ptr < end) {
+      byte *event_ptr = ptr;
+      unsigned long delta_ticks = *ptr++;
+      if (delta_ticks & 0x80) { // a multi-byte delta time is rarer
+         ptr = event_ptr;
+         delta_ticks = get_varlen(&ptr); }
+      byte event = *ptr < 0x80 ? last_event : *ptr++;
+      switch (event >> 4) {
+      case 0xa: case 0xb: case 0xe: // two data bytes
+         ptr += 2;
+         break;
+      case 0xd: // one data byte
+         ptr += 1;
+         break;
+      case 0xf:
+         if (event != 0xff) { // sysex
+            unsigned long sysex_length = get_varlen(&ptr);
+            ptr += sysex_length;
+            break; } // otherwise a meta-event, so fall into the default
+      default: // an event find_next_note needs to look at
+         ptr = event_ptr;
+         goto done; }
+      if (event < 0xf0) last_event = event;
+      time += delta_ticks; }
+done:
+   t->trkptr = ptr;
+   t->time = time;
+   t->last_event = last_event; }
+
 // Skip in the track for the next "note on", "note off" or "set tempo" command and return.
 
 void find_next_note (int tracknum) {
@@ -1330,10 +2562,14 @@ void find_next_note (int tracknum) {
    char *tag;
 
    struct track_status *t = &track[tracknum];   // our track status structure
+   bool log = logparse && t->only_channel <= 0; // log virtual tracks from -splitchannels only once
    while (t->trkptr < t->trkend) {
+      if (!log) {
+         skip_ignored_events(t);
+         if (t->trkptr >= t->trkend) break; }
       delta_ticks = get_varlen (&t->trkptr);
       t->time += delta_ticks;
-      if (logparse) {
+      if (log) {
          fprintf(logfile, "# trk %d ", tracknum);
          if (loggen) fprintf(logfile, "at ticks+%lu=%lu: ", delta_ticks, t->time);
          else {
@@ -1348,7 +2584,7 @@ void find_next_note (int tracknum) {
          meta_length = get_varlen (&t->trkptr);
          switch (meta_cmd) {
          case 0x00:
-            if (logparse) fprintf (logfile, "sequence number %d\n", rev_short (*(unsigned short *) t->trkptr));
+            if (log) fprintf (logfile, "sequence number %d\n", rev_short (*(unsigned short *) t->trkptr));
             break;
          case 0x01:
             tag = "description"; goto show_text;
@@ -1356,9 +2592,10 @@ void find_next_note (int tracknum) {
             tag = "copyright"; goto show_text;
          case 0x03:
             tag = "track name";
-            if (tracknum == 0 && !parseonly && !binaryoutput) {
+            if (tracknum == 0 && !parseonly && !scanning && !binaryoutput) {
                /* Incredibly, MIDI has no standard for recording the name of the piece!
                   Track 0's "trackname" is often used for that so we output it to the C file as documentation. */
+               emit_drain(); // after the commands before it
                fprintf (outfile, "// ");
                for (int i = 0; i < meta_length; ++i) {
                   int ch = t->trkptr[i];
@@ -1378,7 +2615,7 @@ void find_next_note (int tracknum) {
          case 0x09:
             tag = "device (port) name";
 show_text:
-            if (logparse) {
+            if (log) {
                fprintf (logfile, "meta cmd %02X, length %d, %s: \"", meta_cmd, meta_length, tag);
                for (int i = 0; i < meta_length; ++i) {
                   int ch = t->trkptr[i];
@@ -1386,37 +2623,40 @@ show_text:
                fprintf (logfile, "\"\n"); }
             break;
          case 0x20:
-            if (logparse) fprintf (logfile, "channel prefix %d\n", *t->trkptr);
+            if (log) fprintf (logfile, "channel prefix %d\n", *t->trkptr);
             break;
          case 0x21:
-            if (logparse) fprintf(logfile, "MIDI port %d\n", *t->trkptr);
+            if (log) fprintf(logfile, "MIDI port %d\n", *t->trkptr);
+            t->port = *t->trkptr & 0x7f; // subsequent channels in this track are for that port
+            make_channels(t->port * NUM_CHANNELS);
             break;
          case 0x2f:
-            if (logparse) fprintf (logfile, "end of track\n");
+            if (log) fprintf (logfile, "end of track\n");
             break;
          case 0x51:    // tempo: 3 byte big-endian integer, not a varlen integer!
+            if (t->only_channel > 0) break; // only one virtual track from -splitchannels sets the tempo
             t->cmd = CMD_TEMPO;
             t->tempo = rev_long (*(uint32_t *) (t->trkptr - 1)) & 0xffffffL;
-            if (logparse) fprintf (logfile, "set tempo %ld usec/qnote\n", t->tempo);
+            if (log) fprintf (logfile, "set tempo %ld usec/qnote\n", t->tempo);
             t->trkptr += meta_length;
             return;
          case 0x54:
-            if (logparse) fprintf (logfile, "SMPTE offset %08" PRIx32 "\n",
+            if (log) fprintf (logfile, "SMPTE offset %08" PRIx32 "\n",
                                       rev_long (*(uint32_t *) t->trkptr));
             break;
          case 0x58:
-            if (logparse) fprintf (logfile, "time signature %08" PRIx32 "\n",
+            if (log) fprintf (logfile, "time signature %08" PRIx32 "\n",
                                       rev_long (*(uint32_t *) t->trkptr));
             break;
          case 0x59:
-            if (logparse) fprintf (logfile, "key signature %04X\n", rev_short (*(unsigned short *) t->trkptr));
+            if (log) fprintf (logfile, "key signature %04X\n", rev_short (*(unsigned short *) t->trkptr));
             break;
          case 0x7f:
             tag = "sequencer data"; goto show_hex;
          default:              /* unknown meta command */
             tag = "???";
 show_hex:
-            if (logparse) {
+            if (log) {
                fprintf (logfile, "meta cmd %02X, length %d, %s: ", meta_cmd, meta_length, tag);
                for (int i = 0; i < meta_length; ++i)
                   fprintf (logfile, "%02X ", t->trkptr[i]);
@@ -1429,15 +2669,17 @@ show_hex:
       else {
          if (event < 0xf0)
             t->last_event = event;      // remember "running status" if not meta or sysex event
-         t->chan = chan = event & 0xf;
+         chan = event & 0xf;
+         t->chan = t->port * NUM_CHANNELS + chan;
          switch (event >> 4) {
          case 0x8: // note off
             t->note = *t->trkptr++;
             t->volume = *t->trkptr++;
-note_off:   if (logparse) fprintf(logfile, "note %d (0x%02X) off, channel %d, volume %d\n", t->note, t->note, chan, t->volume);
-            if ((1 << chan) & channel_mask  // we're processing this channel
+note_off:   if (log) fprintf(logfile, "note %d (0x%02X) off, channel %d, volume %d\n", t->note, t->note, chan, t->volume);
+            if (channel_selected(t->chan)  // we're processing this channel
+                  && (t->only_channel < 0 || chan == t->only_channel) // and it's in this (maybe virtual) track
                   && (!percussion_ignore || chan != PERCUSSION_TRACK)) {  // and not ignoring percussion
-               if (!instrumentoutput) t->chan = 0; // if no instruments, force all notes to channel 0
+               if (!instrumentoutput && !scanning) t->chan = 0; // if no instruments, force all notes to channel 0
                t->cmd = CMD_STOPNOTE;    /* stop processing and return */
                return; }
             break;
@@ -1446,39 +2688,41 @@ note_off:   if (logparse) fprintf(logfile, "note %d (0x%02X) off, channel %d, vo
             t->volume = *t->trkptr++;
             if (t->volume == 0)  // some scores use note-on with zero velocity for off!
                goto note_off;
-            if (logparse) fprintf(logfile, "note %d (0x%02X) on,  channel %d, volume %d\n", t->note, t->note, chan, t->volume);
-            if ((1 << chan) & channel_mask // we're processing this channel
+            if (log) fprintf(logfile, "note %d (0x%02X) on,  channel %d, volume %d\n", t->note, t->note, chan, t->volume);
+            if (channel_selected(t->chan) // we're processing this channel
+                  && (t->only_channel < 0 || chan == t->only_channel) // and it's in this (maybe virtual) track
                   && (!percussion_ignore || chan != PERCUSSION_TRACK)) {  // and not ignoring percussion
-               if (!instrumentoutput) t->chan = 0; // if no instruments, force all notes to channel 0
+               if (!instrumentoutput && !scanning) t->chan = 0; // if no instruments, force all notes to channel 0
                t->cmd = CMD_PLAYNOTE;    /* stop processing and return */
                return; }
             break;
          case 0xa: // key pressure
             note = *t->trkptr++;
             velocity = *t->trkptr++;
-            if (logparse) fprintf (logfile, "channel %d: note %d (0x%02X) has key pressure %d\n", chan, note, note, velocity);
+            if (log) fprintf (logfile, "channel %d: note %d (0x%02X) has key pressure %d\n", chan, note, note, velocity);
             break;
          case 0xb: // control value change
             controller = *t->trkptr++;
             velocity = *t->trkptr++;
-            if (logparse) fprintf (logfile, "channel %d: change control value of controller %d to %d\n", chan, controller, velocity);
+            if (log) fprintf (logfile, "channel %d: change control value of controller %d to %d\n", chan, controller, velocity);
             break;
          case 0xc: // program patch, ie which instrument
             instrument = *t->trkptr++;
-            channel[chan].instrument = instrument;    // record new instrument for this channel
-            if (logparse) fprintf (logfile, "channel %d: program patch to instrument %d\n", chan, instrument);
+            if (t->only_channel < 0 || chan == t->only_channel)
+               channel[t->chan].instrument = instrument;    // record new instrument for this channel
+            if (log) fprintf (logfile, "channel %d: program patch to instrument %d\n", chan, instrument);
             break;
          case 0xd: // channel pressure
             pressure = *t->trkptr++;
-            if (logparse) fprintf (logfile, "channel %d: after-touch pressure is %d\n", chan, pressure);
+            if (log) fprintf (logfile, "channel %d: after-touch pressure is %d\n", chan, pressure);
             break;
          case 0xe: // pitch wheel change
             pitchbend = *t->trkptr++ | (*t->trkptr++ << 7);
-            if (logparse) fprintf (logfile, "pitch wheel change to %d\n", pitchbend);
+            if (log) fprintf (logfile, "pitch wheel change to %d\n", pitchbend);
             break;
          case 0xf: // sysex event
             sysex_length = get_varlen (&t->trkptr);
-            if (logparse) fprintf (logfile, "SysEx event %d with %ld bytes\n", event, sysex_length);
+            if (log) fprintf (logfile, "SysEx event %d with %ld bytes\n", event, sysex_length);
             t->trkptr += sysex_length;
             break;
          default:
@@ -1490,33 +2734,118 @@ void show_noteinfo_slots(int channum) {
    struct channel_status *cp = &channel[channum];
    if (loggen) {
       fprintf(logfile, "notes playing for channel %d:\n", channum);
-      for (int ndx = 0; ndx < MAX_CHANNELNOTES; ++ndx)
+      for (int ndx = 0; ndx < channel_notes; ++ndx)
          if (cp->note_playing[ndx]) {
             struct noteinfo *np = &cp->notes_playing[ndx];
             fprintf(logfile, "  %2d: %s\n", ndx, describe(np)); } } }
 
-void process_track_data(void) {
-   unsigned long last_earliest_time = 0;
-
-   do { // while there are still track notes to process
-
-      /* Find the track with the earliest event time, and process it's event.
-
-      A potential improvement: If there are multiple tracks with the same time,
-      first do the ones with STOPNOTE as the next command, if any.  That would
-      help avoid running out of tone generators.  In practice, though, most MIDI
-      files do all the STOPNOTEs first anyway, so it won't have much effect.
-
-      Usually we start with the track after the one we did last time (tracknum),
-      so that if we run out of tone generators, we have been fair to all the tracks.
-      The alternate "strategy1" says we always start with track 0, which means
-      that we favor early tracks over later ones when there aren't enough tone generators. */
-
-      struct track_status *trk;
-      int count_tracks = num_tracks;
-      unsigned long earliest_time = 0x7fffffff; // in ticks, of course
-      int tracknum = 0;
-      int earliest_tracknum;
+/* note_importance needs to know which notes are playing, in the whole song and in each track.
+   Looking through the note slots of all the channels for that is slow when thousands of notes
+   are playing, so we also count the notes in the slots, with a bit for each note that is
+   playing at least once. [0] is for the whole song, and [tracknum + 1] for each track. */
+struct keys_playing {
+   uint64_t bits[2];             // which notes 0..127 are playing
+   uint32_t counts[128];         // and how many times
+} *keys_playing = NULL;
+
+void count_key(struct keys_playing *kp, int note, bool on) {
+   if (on) {
+      if (kp->counts[note]++ == 0) kp->bits[note >> 6] |= 1ULL << (note & 63); }
+   else if (--kp->counts[note] == 0) kp->bits[note >> 6] &= ~(1ULL << (note & 63)); }
+
+void key_playing(int tracknum, int note, bool on) { // a note was put into, or taken out of, a slot
+   if (note < 128) { // translated percussion doesn't count
+      count_key(&keys_playing[0], note, on);
+      count_key(&keys_playing[tracknum + 1], note, on); } }
+
+bool keys_below(struct keys_playing *kp, int note) { // is a lower note playing?
+   if (note < 64) return (kp->bits[0] & ((1ULL << note) - 1)) != 0;
+   return kp->bits[0] || (kp->bits[1] & ((1ULL << (note - 64)) - 1)); }
+
+bool keys_above(struct keys_playing *kp, int note) { // is a higher note playing?
+   if (note < 64) return (kp->bits[0] & ~((2ULL << note) - 1)) || kp->bits[1];
+   return (kp->bits[1] & ~((2ULL << (note - 64)) - 1)) != 0; }
+
+// Estimate how important a note that is starting is, in case there aren't enough tone generators.
+// Louder notes matter more, and so does the highest note playing in its track, which is probably
+// the melody, and the lowest note playing in any track, which is probably the bass line.
+// The duration is added later, when the note stops.
+int note_importance(struct noteinfo *np) {
+   int importance = np->volume;
+   if (np->note >= 128) return importance; // translated percussion is neither melody nor bass
+   // (the note isn't counted in keys_playing yet)
+   if (!keys_above(&keys_playing[np->track + 1], np->note)) importance += 64; // the highest in its track
+   if (!keys_below(&keys_playing[0], np->note)) importance += 32; // the lowest of all
+   return importance; }
+
+/* With many tracks, looking at all of them to find the next event is slow, so then we keep
+   the tracks in a heap ordered by the time of their next event. Ties are broken the way
+   the search breaks them, so the order of events is the same: the lowest track number first,
+   except that without -s1 track 0 comes last. Only the track at the top of the heap is ever
+   processed, so that's the only one whose time changes between calls. */
+
+#define TRACK_HEAP_MIN 12       // use the heap for at least this many tracks
+struct track_heap_entry {
+   unsigned long time;          // a copy of the track's time, so we compare without looking at the track
+   int order;                   // which of the tracks with the same time goes first
+   int tracknum;
+} *track_heap = NULL;           // earliest first
+int track_heap_count = 0;
+
+bool track_before(struct track_heap_entry *a, struct track_heap_entry *b) {
+   return a->time < b->time || (a->time == b->time && a->order < b->order); }
+
+void track_heap_down(int pos) { // move an entry down to where it belongs
+   struct track_heap_entry entry = track_heap[pos];
+   while (2 * pos + 1 < track_heap_count) {
+      int child = 2 * pos + 1;
+      if (child + 1 < track_heap_count && track_before(&track_heap[child + 1], &track_heap[child])) ++child;
+      if (!track_before(&track_heap[child], &entry)) break;
+      track_heap[pos] = track_heap[child];
+      pos = child; }
+   track_heap[pos] = entry; }
+
+int track_heap_next(void) { // return the track with the earliest event
+   if (!track_heap) { // the first time: put all the tracks with events in it
+      track_heap = (struct track_heap_entry *) arena_alloc(num_tracks * sizeof(struct track_heap_entry));
+      assert(track_heap != NULL, "can't allocate the track heap");
+      for (int tracknum = 0; tracknum < num_tracks; ++tracknum)
+         if (track[tracknum].cmd != CMD_TRACKDONE) {
+            struct track_heap_entry *ep = &track_heap[track_heap_count++];
+            ep->time = track[tracknum].time;
+            ep->order = tracknum == 0 && !strategy1 ? num_tracks : tracknum; // track 0 goes last
+            ep->tracknum = tracknum; }
+      for (int pos = track_heap_count / 2 - 1; pos >= 0; --pos) track_heap_down(pos); }
+   else { // the track we returned last time has moved on to its next event, or is done
+      struct track_status *trk = &track[track_heap[0].tracknum];
+      if (trk->cmd == CMD_TRACKDONE) track_heap[0] = track_heap[--track_heap_count];
+      else track_heap[0].time = trk->time;
+      track_heap_down(0); }
+   assert(track_heap_count > 0, "no tracks left in the heap");
+   return track_heap[0].tracknum; }
+
+/* Find the track with the earliest event time, and make its time the current time.
+
+   A potential improvement: If there are multiple tracks with the same time,
+   first do the ones with STOPNOTE as the next command, if any.  That would
+   help avoid running out of tone generators.  In practice, though, most MIDI
+   files do all the STOPNOTEs first anyway, so it won't have much effect.
+
+   Usually we start with the track after the one we did last time (tracknum),
+   so that if we run out of tone generators, we have been fair to all the tracks.
+   The alternate "strategy1" says we always start with track 0, which means
+   that we favor early tracks over later ones when there aren't enough tone generators. */
+
+int earliest_track(unsigned long *last_earliest_time) {
+   struct track_status *trk;
+   int count_tracks = num_tracks;
+   unsigned long earliest_time = 0x7fffffff; // in ticks, of course
+   int tracknum = 0;
+   int earliest_tracknum;
+   if (num_tracks >= TRACK_HEAP_MIN) {
+      earliest_tracknum = track_heap_next();
+      earliest_time = track[earliest_tracknum].time; }
+   else {
       if (strategy1)
          tracknum = num_tracks;      /* beyond the end, so we start with track 0 */
       do {
@@ -1525,18 +2854,25 @@ void process_track_data(void) {
          if (trk->cmd != CMD_TRACKDONE && trk->time < earliest_time) {
             earliest_time = trk->time;
             earliest_tracknum = tracknum; } }
-      while (--count_tracks);
-      tracknum = earliest_tracknum;  /* the track we picked */
-      trk = &track[tracknum];
-      assert(earliest_time >= timenow_ticks, "time went backwards in process_track_data");
-      timenow_ticks = earliest_time; // we make it the global time
-      timenow_usec += (uint64_t)(timenow_ticks - timenow_usec_updated) * tempo / ticks_per_beat;
-      timenow_usec_updated = timenow_ticks;  // usec version is updated based on the current tempo
-      if (loggen) {
-         if (earliest_time != last_earliest_time) {
-            fprintf(logfile, "->process trk %d at time %lu.%03lu msec (%lu ticks)\n",
-                    tracknum, timenow_usec / 1000, timenow_usec % 1000, timenow_ticks);
-            last_earliest_time = earliest_time; } }
+      while (--count_tracks); }
+   tracknum = earliest_tracknum;  /* the track we picked */
+   assert(earliest_time >= timenow_ticks, "time went backwards in process_track_data");
+   timenow_ticks = earliest_time; // we make it the global time
+   timenow_usec += (uint64_t)(timenow_ticks - timenow_usec_updated) * tempo / ticks_per_beat;
+   timenow_usec_updated = timenow_ticks;  // usec version is updated based on the current tempo
+   if (loggen) {
+      if (earliest_time != *last_earliest_time) {
+         fprintf(logfile, "->process trk %d at time %lu.%03lu msec (%lu ticks)\n",
+                 tracknum, timenow_usec / 1000, timenow_usec % 1000, timenow_ticks);
+         *last_earliest_time = earliest_time; } }
+   return tracknum; }
+
+void process_track_data(void) {
+   unsigned long last_earliest_time = 0;
+
+   do { // while there are still track notes to process
+      int tracknum = earliest_track(&last_earliest_time);
+      struct track_status *trk = &track[tracknum];
       struct channel_status *cp = &channel[trk->chan];  // the channel info, if play or stop
 
       if (trk->cmd == CMD_TEMPO) { // change the global tempo, which affects future usec computations
@@ -1547,7 +2883,7 @@ void process_track_data(void) {
          find_next_note(tracknum); }
 
       else { // should be PLAYNOTE or STOPNOTE
-         if (percussion_translate && trk->chan == PERCUSSION_TRACK)
+         if (percussion_translate && trk->chan % NUM_CHANNELS == PERCUSSION_TRACK)
             trk->note += 128;  // maybe move percussion notes up to 128..255
          else {  // shift notes as requested
             trk->note += keyshift;
@@ -1555,13 +2891,9 @@ void process_track_data(void) {
             if (trk->note > 127) trk->note = 127; }
 
          if (trk->cmd == CMD_STOPNOTE) {
-            int ndx;  // find the noteinfo for this note -- which better be playing -- in the channel status
-            for (ndx = 0; ndx < MAX_CHANNELNOTES; ++ndx) {
-               if (cp->note_playing[ndx]
-                     && cp->notes_playing[ndx].note == trk->note
-                     && cp->notes_playing[ndx].track == tracknum)
-                  break; }
-            if (ndx >= MAX_CHANNELNOTES) {
+            // find the noteinfo for this note -- which better be playing -- in the channel status
+            int ndx = find_note_slot(cp, trk->note, tracknum);
+            if (ndx < 0) {
                ++noteinfo_notfound; // presumably the array overflowed on input
                if (loggen) fprintf(logfile, "  *** noteinfo slot not found to stop track %d note %d (%02X) channel %d\n",
                                       tracknum, trk->note, trk->note, trk->chan); }
@@ -1569,34 +2901,49 @@ void process_track_data(void) {
                // Analyze the sustain and release parameters. We might generate another "note on"
                // command with reduced volume, and/or move the stopnote command earlier than now.
                struct noteinfo *np = &cp->notes_playing[ndx];
-               unsigned long duration_usec = timenow_usec - np->time_usec; // it has the start time in it
+               timestamp stop_usec = timenow_usec;
+               bool stop_output = false; // is the stop already queued or output?
+               if (percussionmax_usec && np->note >= 128) { // the stop queued when it started
+                  timestamp max_usec = np->time_usec + percussionmax_usec;
+                  if (max_usec <= stop_usec) { // is when it stops, so keep it where it is
+                     if (max_usec < stop_usec) ++percussion_notes_released;
+                     stop_usec = max_usec;
+                     stop_output = true; }
+                  else stop_output = !queue_remove_percussion_stop(np, max_usec); } // or replace it
+               unsigned long duration_usec = stop_usec - np->time_usec; // it has the start time in it
                unsigned long truncation;
-               if (duration_usec <= notemin_usec) truncation = 0;
+               if (duration_usec <= notemin_usec || stop_output) truncation = 0;
                else if (duration_usec < releasetime_usec + notemin_usec) truncation = duration_usec - notemin_usec;
                else truncation = releasetime_usec;
-               if (attacktime_usec > 0 && duration_usec < attacknotemax_usec) {
+               // longer notes are more important, up to a point
+               add_importance(np, duration_usec / 16000 < 64 ? duration_usec / 16000 : 64);
+               if (attacktime_usec > 0 && duration_usec < attacknotemax_usec && !stop_output) {
                   if (duration_usec - truncation > attacktime_usec) { // do a sustain phase
                      if ((np->volume = np->volume * sustainlevel_pct / 100) <= 0) np->volume = 1;
                      np->time_usec += attacktime_usec; // adjust time to be when sustain phase starts
+                     np->kind = EVENT_SUSTAIN;
+                     if (export_events) export_event(np);
                      queue_cmd(CMD_PLAYNOTE, np);
                      ++sustainphases_done; }
                   else ++sustainphases_skipped; }
-               np->time_usec = timenow_usec - truncation; // adjust time to be when the note stops
-               queue_cmd(CMD_STOPNOTE, np);
-               cp->note_playing[ndx] = false; }
+               np->time_usec = stop_usec - truncation; // adjust time to be when the note stops
+               np->kind = EVENT_STOP;
+               np->tick = timenow_ticks;
+               if (export_events) export_event(np);
+               if (!stop_output) queue_cmd(CMD_STOPNOTE, np);
+               free_slot(cp, ndx, np->note);
+               key_playing(np->track, np->note, false); }
             find_next_note(tracknum); }
 
          else if (trk->cmd == CMD_PLAYNOTE) { // Process only one "start note", so other tracks get a chance at tone generators
-            int ndx;  // find an unused noteinfo slot to use
-            for (ndx = 0; ndx < MAX_CHANNELNOTES; ++ndx) {
-               if (!cp->note_playing[ndx]) break; }
-            if (ndx >= MAX_CHANNELNOTES) {
+            int ndx = find_free_slot(cp);  // find an unused noteinfo slot to use
+            if (ndx < 0) {
                ++noteinfo_overflow; // too many simultaneous notes
                if (loggen) fprintf(logfile, "  *** no noteinfo slot to queue track %d note %d (%02X) channel %d\n",
                                       tracknum, trk->note, trk->note, trk->chan);
-               show_noteinfo_slots(tracknum); }
+               show_noteinfo_slots(trk->chan); }
             else {
-               cp->note_playing[ndx] = true;  // assign it to us
+               use_slot(cp, ndx, trk->note);  // assign it to us
                struct noteinfo *pn = &cp->notes_playing[ndx];
                pn->time_usec = timenow_usec; // fill it in
                pn->track = tracknum;
@@ -1604,7 +2951,19 @@ void process_track_data(void) {
                pn->note = trk->note;
                pn->instrument = cp->instrument;
                pn->volume = trk->volume;
-               queue_cmd(CMD_PLAYNOTE, pn); }
+               pn->importance = note_importance(pn);
+               pn->kind = EVENT_PLAY;
+               pn->tick = timenow_ticks;
+               key_playing(tracknum, pn->note, true);
+               if (export_events) export_event(pn);
+               queue_cmd(CMD_PLAYNOTE, pn);
+               if (percussionmax_usec && pn->note >= 128) {
+                  // For -percussionmax, also queue a stop now, in case the "note off" is late or
+                  // missing. When the "note off" comes, it replaces this if it hasn't been output yet.
+                  struct noteinfo stop = *pn;
+                  stop.time_usec += percussionmax_usec;
+                  stop.kind = EVENT_STOP;
+                  queue_cmd(CMD_STOPNOTE, &stop); } }
             find_next_note(tracknum); }   // use up the note
 
          else assert(false, "bad cmd in process_track_data"); } }
@@ -1618,35 +2977,379 @@ void process_track_data(void) {
       fprintf(logfile, "ending output_usec:  %lu.%03lu\n", output_usec / 1000, output_usec % 1000); }
    assert(timenow_usec >= output_usec, "time deficit at end of song");
    generate_delay((timenow_usec - output_usec) / 1000);
-   if (binaryoutput) {
-      putc(gen_restart ? CMD_RESTART : CMD_STOP, outfile);
-      outfile_bytecount +=1; }
-   else {
-      fprintf(outfile, "0x%02X};", gen_restart ? CMD_RESTART : CMD_STOP);
-      outfile_items(1);
-      fprintf(outfile, "\n"); } }
+   output_end(gen_restart ? CMD_RESTART : CMD_STOP); }
 
 
 /*********************  main  ****************************/
 
-int main (int argc, char *argv[]) {
-   int argno;
-   char *filebasename;
-   int basenamelen;
-#define MAXPATH 120
-   char filename[MAXPATH];
+/*********************  scanning a MIDI file  ****************************/
+
+/* -scan profiles a MIDI file without converting it, to help choose the options and the
+   board for it. The tracks are merged in time order just like for a conversion, but
+   instead of queuing the notes for tone generators we only count them. */
+
+struct scan_status {           // what -scan learns about one channel, or about the whole song
+   int notes, sounding, peak;  // how many notes started, are sounding now, and were sounding at most
+   byte lowest_note, highest_note;
+   uint64_t sounding_usec;     // the sum over time of how many notes were sounding, for the average
+   timestamp changed_usec;     // when "sounding" last changed
+   uint32_t instruments[4];    // a bit for each instrument that played a note
+   uint16_t keys_down[128];    // how many times each note is sounding
+   int slots_used;             // for -estimate, the channel's note slots that the conversion would use
+   struct estimate_slot {
+      int track, note;
+   } *slots;                   //   with room for channel_notes of them
+} *scan_channels = NULL, scan_song;
+int scan_num_channels = 0;
+
+struct scan_status *scan_channel(int channum) {
+   if (channum >= scan_num_channels) {
+      scan_channels = (struct scan_status *) arena_grow(scan_channels, scan_num_channels * sizeof(struct scan_status),
+                      num_channels * sizeof(struct scan_status));
+      if (!scan_channels) out_of_memory("channels", num_channels);
+      static const struct scan_status empty_scan = { 0 };
+      while (scan_num_channels < num_channels) {
+         scan_channels[scan_num_channels] = empty_scan;
+         if (estimate_only && !(scan_channels[scan_num_channels].slots =
+                                   (struct estimate_slot *) arena_alloc(channel_notes * sizeof(struct estimate_slot))))
+            out_of_memory("channels", num_channels);
+         ++scan_num_channels; } }
+   return &scan_channels[channum]; }
+
+void scan_count(struct scan_status *sp, int note, int instrument, bool on) {
+   sp->sounding_usec += (uint64_t)sp->sounding * (timenow_usec - sp->changed_usec);
+   sp->changed_usec = timenow_usec;
+   if (on) {
+      if (sp->notes == 0 || note < sp->lowest_note) sp->lowest_note = note;
+      if (sp->notes == 0 || note > sp->highest_note) sp->highest_note = note;
+      ++sp->notes;
+      sp->instruments[instrument >> 5] |= 1UL << (instrument & 31);
+      ++sp->keys_down[note];
+      if (++sp->sounding > sp->peak) sp->peak = sp->sounding; }
+   else if (sp->keys_down[note] > 0) { // ignore "note off" for notes that aren't on
+      --sp->keys_down[note];
+      --sp->sounding; } }
+
+/* -estimate predicts, during the same quick pass as -scan, what converting the file would
+   produce with each number of tone generators from 1 to 16. For each one we keep a simple
+   model of the generators: a note takes a free one, preferably one that last played the same
+   instrument, or is skipped if none are free. We count the bytes the commands and delays would
+   take; the delays are the same for all of them. That ignores the finer points of the real
+   conversion, like -importance, -recover, -releasetime and the output queue, so the numbers
+   are close but not exact. */
+
+struct estimate_model {             // the model for one number of tone generators
+   struct {
+      bool playing;
+      int track, channel, note, instrument;
+      timestamp start_usec, stop_usec;
+   } tgen[MAX_TONEGENS];
+   int tgens_used, notes, skipped;
+   long bytes;
+} estimates[MAX_TONEGENS];          // [n] is for n+1 tone generators
+long estimate_delay_bytes = 0;
+timestamp estimate_output_usec = 0; // when we last output a delay
+
+void estimate_note(int tracknum, int channum, int note, int instrument, bool on) {
+   if (percussion_translate && channum % NUM_CHANNELS == PERCUSSION_TRACK) note += 128;
+   if (!instrumentoutput) channum = 0; // the conversion puts all notes on channel 0
+   struct scan_status *sp = scan_channel(channum); // and drops the notes that don't fit in its note slots
+   int ndx;
+   for (ndx = 0; ndx < sp->slots_used && !(sp->slots[ndx].track == tracknum && sp->slots[ndx].note == note); ++ndx) ;
+   if (on) {
+      if (sp->slots_used >= channel_notes) return;
+      sp->slots[sp->slots_used].track = tracknum;
+      sp->slots[sp->slots_used++].note = note; }
+   else {
+      if (ndx >= sp->slots_used) return;
+      sp->slots[ndx] = sp->slots[--sp->slots_used]; }
+   unsigned long delta_usec = timenow_usec - estimate_output_usec; // it will be queued, so time moves on
+   if (delta_usec > delaymin_usec && delta_usec >= 1000) {
+      estimate_delay_bytes += 2 * ((delta_usec / 1000 + 0x7ffe) / 0x7fff); // delays over 0x7fff msec take several
+      estimate_output_usec = timenow_usec; }
+   for (int num_tgens = 1; num_tgens <= MAX_TONEGENS; ++num_tgens) {
+      struct estimate_model *mp = &estimates[num_tgens - 1];
+      int tgnum, freegen = -1;
+      for (tgnum = 0; tgnum < num_tgens; ++tgnum) {
+         if (mp->tgen[tgnum].playing) { // like the conversion, a stop is for that note from any track
+            if ((!on || mp->tgen[tgnum].track == tracknum) && mp->tgen[tgnum].channel == channum
+                  && mp->tgen[tgnum].note == note) break; }
+         else if (freegen < 0 || (mp->tgen[tgnum].instrument == instrument && mp->tgen[freegen].instrument != instrument))
+            freegen = tgnum; }
+      if (!on) {
+         if (tgnum < num_tgens) { // stop the note if it wasn't skipped
+            unsigned long duration_usec = timenow_usec - mp->tgen[tgnum].start_usec;
+            if (attacktime_usec > 0 && duration_usec < attacknotemax_usec && duration_usec > attacktime_usec)
+               mp->bytes += (volume_output ? 3 : 2) + 2; // the sustain phase, and the delay before it
+            mp->tgen[tgnum].playing = false;
+            mp->tgen[tgnum].stop_usec = timenow_usec;
+            mp->bytes += 1; } }
+      else {
+         if (tgnum >= num_tgens) { // not a restart of a playing note
+            if (freegen < 0) {
+               ++mp->skipped;
+               continue; }
+            tgnum = freegen;
+            if (mp->tgen[tgnum].stop_usec == timenow_usec)
+               mp->bytes -= 1; // the stop we just counted won't be needed
+            if (instrumentoutput && mp->tgen[tgnum].instrument != instrument)
+               mp->bytes += 2;
+            mp->tgen[tgnum].playing = true;
+            mp->tgen[tgnum].track = tracknum;
+            mp->tgen[tgnum].channel = channum;
+            mp->tgen[tgnum].note = note;
+            mp->tgen[tgnum].instrument = instrument;
+            mp->tgen[tgnum].start_usec = timenow_usec;
+            if (tgnum + 1 > mp->tgens_used) mp->tgens_used = tgnum + 1; }
+         ++mp->notes;
+         mp->bytes += volume_output ? 3 : 2; } } }
+
+void report_estimates(void) {
+   int needed = 0;
+   for (int num_tgens = 1; num_tgens <= MAX_TONEGENS; ++num_tgens) {
+      struct estimate_model *mp = &estimates[num_tgens - 1];
+      mp->bytes += estimate_delay_bytes + (do_header ? sizeof(file_header) : 0) + 1; // and the final "stop" or "restart"
+      if (timenow_usec - estimate_output_usec >= 1000) mp->bytes += 2; // the delay to the end
+      if (!needed && mp->skipped == 0) needed = num_tgens; }
+   if (needed) printf("  Estimate: %d tone generators are needed to play all %d notes\n", needed, scan_song.notes);
+   else printf("  Estimate: even %d tone generators can't play all %d notes\n", MAX_TONEGENS, scan_song.notes);
+   for (int num_tgens = 1; num_tgens <= MAX_TONEGENS; ++num_tgens) {
+      struct estimate_model *mp = &estimates[num_tgens - 1];
+      printf("    -t=%-2d  %5d notes skipped, about %6ld bytes%s\n", num_tgens, mp->skipped, mp->bytes,
+             num_tgens == num_tonegens ? "   <-- this -t" : "");
+      if (mp->skipped == 0 && num_tgens >= num_tonegens) break; } // more won't change anything
+   // report what the conversion with our -t would probably have done
+   struct estimate_model *mp = &estimates[num_tonegens - 1];
+   outfile_bytecount = mp->bytes;
+   note_on_commands = mp->notes;
+   notes_skipped = mp->skipped;
+   num_tonegens_used = mp->tgens_used; }
+
+void scan_track_data(void) {
+   unsigned long last_earliest_time = 0;
+   while (tracks_done < num_tracks) {
+      int tracknum = earliest_track(&last_earliest_time);
+      struct track_status *trk = &track[tracknum];
+      if (trk->cmd == CMD_TEMPO) {
+         if (tempo != trk->tempo) {
+            ++tempo_changes;
+            tempo = trk->tempo; } }
+      else { // PLAYNOTE or STOPNOTE
+         int instrument = channel[trk->chan].instrument;
+         scan_count(scan_channel(trk->chan), trk->note, instrument, trk->cmd == CMD_PLAYNOTE);
+         scan_count(&scan_song, trk->note, instrument, trk->cmd == CMD_PLAYNOTE);
+         if (estimate_only) estimate_note(tracknum, trk->chan, trk->note, instrument, trk->cmd == CMD_PLAYNOTE); }
+      find_next_note(tracknum); } }
+
+// the average number of notes sounding, in thousandths
+unsigned scan_average(struct scan_status *sp) {
+   uint64_t sounding_usec = sp->sounding_usec + (uint64_t)sp->sounding * (timenow_usec - sp->changed_usec);
+   return timenow_usec ? (unsigned)(sounding_usec * 1000 / timenow_usec) : 0; }
+
+void write_csv_string(FILE *file, const char *str) {
+   putc('"', file);
+   for (; *str; ++str) {
+      if (*str == '"') putc('"', file); // double the quotes inside
+      putc(*str, file); }
+   putc('"', file); }
+
+void write_scan_header(FILE *file) {
+   fprintf(file, "file,tracks,duration_msec,tempo_changes,channel,notes,peak_notes,average_notes,lowest_note,highest_note,instruments\n"); }
+
+// write a line for the whole song, with "all" as the channel, and then one for each channel that played notes
+void write_scan_rows(FILE *file, const char *name, int tracks) {
+   for (int channum = -1; channum < scan_num_channels; ++channum) {
+      struct scan_status *sp = channum < 0 ? &scan_song : &scan_channels[channum];
+      if (channum >= 0 && sp->notes == 0) continue;
+      unsigned average = scan_average(sp);
+      write_csv_string(file, name);
+      fprintf(file, ",%d,%u,%d,", tracks, (unsigned)(timenow_usec / 1000), tempo_changes);
+      if (channum < 0) fprintf(file, "all");
+      else fprintf(file, "%d", channum);
+      fprintf(file, ",%d,%d,%u.%03u,%d,%d,\"", sp->notes, sp->peak, average / 1000, average % 1000,
+              sp->lowest_note, sp->highest_note);
+      for (int instrument = 0, count = 0; instrument < 128; ++instrument)
+         if (sp->instruments[instrument >> 5] & (1UL << (instrument & 31)))
+            fprintf(file, count++ ? " %d" : "%d", instrument);
+      fprintf(file, "\"\n"); } }
+
+/*********************  measuring the phases of a conversion  ****************************/
+
+/* -stats times each phase of converting a file: reading it and creating the output file,
+   decoding the headers, converting the tracks, and finishing the output. On Linux we
+   also count the cycles, instructions, cache misses and branch misses of each phase with
+   the hardware performance counters, which shows whether a phase is limited by the
+   memory or by mispredicted branches. Containers and virtual machines often don't allow
+   the counters, or only some of them; then we report only what we could get. */
+
+enum phase_t {PHASE_READ, PHASE_HEADERS, PHASE_CONVERT, PHASE_FINISH, NUM_PHASES };
+const char *phase_names[NUM_PHASES] = {"read", "headers", "convert", "finish" };
+enum counter_t {COUNT_CYCLES, COUNT_INSTRUCTIONS, COUNT_CACHE_MISSES, COUNT_BRANCH_MISSES, NUM_COUNTERS };
+const char *counter_names[NUM_COUNTERS] = {"cycles", "instructions", "cache_misses", "branch_misses" };
+
+struct phase_stats {
+   bool done;                     // did this phase happen?
+   uint64_t usec;                 // the elapsed time
+   uint64_t counts[NUM_COUNTERS]; // the hardware event counts
+} phase_stats[NUM_PHASES];
+int current_phase = -1;           // the phase being measured, or -1
+uint64_t phase_start_usec, phase_start_counts[NUM_COUNTERS];
+int counter_fd[NUM_COUNTERS];     // the open performance counters, or -1
+bool counters_opened = false;
+int counters_available = 0;       // how many of the counters we could open
+
+uint64_t usec_now(void) { // a clock that measures elapsed time
+#ifdef CLOCK_MONOTONIC
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+   return (uint64_t)clock() * 1000000 / CLOCKS_PER_SEC;
+#endif
+}
 
-   printf ("MIDITONES V%s, (C) 2011-2021 Len Shustek\n", VERSION);
-   if (argc == 1) {     // no arguments
-      SayUsage (argv[0]);
-      return 1; }
+void open_counters(void) {
+   counters_opened = true;
+   for (int ctr = 0; ctr < NUM_COUNTERS; ++ctr) counter_fd[ctr] = -1;
+#ifdef __linux__
+   static const uint64_t configs[NUM_COUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+   int error = 0;
+   for (int ctr = 0; ctr < NUM_COUNTERS; ++ctr) {
+      struct perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = configs[ctr];
+      attr.exclude_kernel = 1; // count only our own code, which is usually allowed
+      attr.exclude_hv = 1;
+      counter_fd[ctr] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+      if (counter_fd[ctr] >= 0) ++counters_available;
+      else error = errno; }
+   if (counters_available < NUM_COUNTERS)
+      printf("  %s hardware performance counters are available: %s\n",
+             counters_available ? "Not all the" : "No", strerror(error));
+#else
+   printf("  Hardware performance counters are only available on Linux\n");
+#endif
+}
 
-   argno = HandleOptions (argc, argv); // process options
-   if (argno == 0) {
-      fprintf (stderr, "\n*** No basefilename given\n\n");
-      SayUsage (argv[0]);
-      exit (4); }
-   filebasename = argv[argno];
+void read_counters(uint64_t counts[NUM_COUNTERS]) {
+   for (int ctr = 0; ctr < NUM_COUNTERS; ++ctr) {
+      counts[ctr] = 0;
+#ifdef __linux__
+      if (counter_fd[ctr] >= 0 && read(counter_fd[ctr], &counts[ctr], sizeof(counts[ctr])) != sizeof(counts[ctr]))
+         counts[ctr] = 0;
+#endif
+   } }
+
+void end_phase(void) {
+   if (current_phase >= 0) {
+      struct phase_stats *ps = &phase_stats[current_phase];
+      uint64_t counts[NUM_COUNTERS];
+      read_counters(counts);
+      ps->usec += usec_now() - phase_start_usec;
+      for (int ctr = 0; ctr < NUM_COUNTERS; ++ctr)
+         ps->counts[ctr] += counts[ctr] - phase_start_counts[ctr];
+      ps->done = true;
+      current_phase = -1; } }
+
+void start_phase(int phase) {
+   if (!stats) return;
+   end_phase();
+   if (!counters_opened) open_counters();
+   current_phase = phase;
+   read_counters(phase_start_counts);
+   phase_start_usec = usec_now(); }
+
+void reset_stats(void) {
+   static const struct phase_stats no_stats = { 0 };
+   current_phase = -1;
+   for (int phase = 0; phase < NUM_PHASES; ++phase) phase_stats[phase] = no_stats; }
+
+void print_stats(void) {
+   end_phase();
+   for (int phase = 0; phase < NUM_PHASES; ++phase) {
+      struct phase_stats *ps = &phase_stats[phase];
+      if (!ps->done) continue;
+      printf("  %-8s %4u.%03u msec", phase_names[phase], (unsigned)(ps->usec / 1000), (unsigned)(ps->usec % 1000));
+      for (int ctr = 0; ctr < NUM_COUNTERS; ++ctr)
+         if (counter_fd[ctr] >= 0) printf(", %" PRIu64 " %s", ps->counts[ctr], counter_names[ctr]);
+      if (counter_fd[COUNT_CYCLES] >= 0 && counter_fd[COUNT_INSTRUCTIONS] >= 0 && ps->counts[COUNT_CYCLES])
+         printf(", %.2f instructions per cycle", (double)ps->counts[COUNT_INSTRUCTIONS] / ps->counts[COUNT_CYCLES]);
+      printf("\n"); } }
+
+void write_json_stats(FILE *file) { // as another field of a report record
+   end_phase();
+   fprintf(file, ", \"stats\": {");
+   bool first = true;
+   for (int phase = 0; phase < NUM_PHASES; ++phase) {
+      struct phase_stats *ps = &phase_stats[phase];
+      if (!ps->done) continue;
+      fprintf(file, "%s\"%s\": {\"usec\": %" PRIu64, first ? "" : ", ", phase_names[phase], ps->usec);
+      for (int ctr = 0; ctr < NUM_COUNTERS; ++ctr)
+         if (counter_fd[ctr] >= 0) fprintf(file, ", \"%s\": %" PRIu64, counter_names[ctr], ps->counts[ctr]);
+      fprintf(file, "}");
+      first = false; }
+   fprintf(file, "}"); }
+
+/*********************  convert one MIDI file  ****************************/
+
+// forget everything about the previous song, so we can convert another one
+void reset_conversion(void) {
+   static const struct tonegen_status empty_tonegen = { 0 };
+   emit_finish(); // stop writing before we close the output file
+   if (outfile) fclose(outfile); // if the last conversion failed part way through
+   if (logfile) fclose(logfile);
+   outfile = logfile = NULL;
+   arena_reset(); // which frees the file buffer, the channels, and so on
+   buffer = input_data = NULL;
+   for (int tgnum = 0; tgnum < MAX_TONEGENS; ++tgnum) tonegen[tgnum] = empty_tonegen;
+   track = NULL;
+   keys_playing = NULL;
+   track_heap = NULL;
+   track_heap_count = 0;
+   queue = NULL;
+   exported_events = NULL;
+   num_exported_events = exported_events_room = 0;
+   map_entries = NULL;
+   num_map_entries = map_entries_room = map_offset = 0;
+   channel = NULL;
+   num_channels = 0;
+   static const struct scan_status empty_scan = { 0 };
+   scan_channels = NULL;
+   scan_num_channels = 0;
+   scan_song = empty_scan;
+   static const struct estimate_model empty_estimate = { 0 };
+   for (int tgnum = 0; tgnum < MAX_TONEGENS; ++tgnum) estimates[tgnum] = empty_estimate;
+   estimate_delay_bytes = 0;
+   estimate_output_usec = 0;
+   queue_numitems = queue_oldest_ndx = queue_newest_ndx = 0;
+   num_pending = 0;
+   sounding_all.count = sounding_all.peak = sounding_kept.count = sounding_kept.peak = 0;
+   sounding_all.num_channels = sounding_kept.num_channels = 0;
+   sounding_all.playing = sounding_kept.playing = NULL;
+   split_format0 = false;
+   tracks_done = outfile_itemcount = 0;
+   num_tonegens_used = instrument_changes = note_on_commands = notes_skipped = 0;
+   events_delayed = stopnotes_without_playnotes = playnotes_without_stopnotes = 0;
+   sustainphases_skipped = sustainphases_done = consecutive_delays = 0;
+   last_output_was_delay = false;
+   noteinfo_overflow = noteinfo_notfound = 0;
+   instrument_limit_remaps = instrument_limit_drops = percussion_notes_released = 0;
+   notes_preempted = notes_recovered = notes_consolidated = 0;
+   outfile_bytecount = 0;
+   ticks_per_beat = DEFAULT_BEATTIME;
+   timenow_ticks = timenow_usec_updated = 0;
+   timenow_usec = output_usec = 0;
+   output_deficit_usec = 0;
+   tempo_changes = 0;
+   delays_saved = 0; }
+
+int convert_file(char *filebasename, int argc, char *argv[]) { // returns 0 if successful
+   int basenamelen;
+   char filename[MAXPATH];
 
    // strip off trailing .mid or .MID extension if provided by user
    basenamelen = strlength(filebasename);
@@ -1654,6 +3357,8 @@ int main (int argc, char *argv[]) {
          (charcmp (filebasename + basenamelen - 4, ".mid") ||
           charcmp (filebasename + basenamelen - 4, ".MID"))) {
       filebasename[basenamelen - 4] = 0; }
+   reset_stats();
+   start_phase(PHASE_READ);
 
    if (logparse || loggen) { // open the log file
       miditones_strlcpy (filename, filebasename, MAXPATH);
@@ -1673,24 +3378,28 @@ int main (int argc, char *argv[]) {
    // open the input file
    miditones_strlcpy (filename, filebasename, MAXPATH);
    miditones_strlcat (filename, ".mid", MAXPATH);
-   infile = fopen (filename, "rb");
-   if (!infile) {
-      fprintf (stderr, "Unable to open input file %s\n", filename);
-      return 1; }
+   if (input_data) { // it's already in memory, from an archive
+      buffer = input_data;
+      buflen = input_length; }
+   else {
+      infile = fopen (filename, "rb");
+      if (!infile) {
+         fprintf (stderr, "Unable to open input file %s\n", filename);
+         return 1; }
 
-   // Read the whole input file into memory
-   fseek (infile, 0, SEEK_END); // find its size
-   buflen = ftell (infile);
-   fseek (infile, 0, SEEK_SET);
-   buffer = (byte *) malloc (buflen + 1);
-   if (!buffer) {
-      fprintf (stderr, "Unable to allocate %ld bytes for the file\n", buflen);
-      return 1; }
-   fread (buffer, buflen, 1, infile);
-   fclose (infile);
+      // Read the whole input file into memory
+      fseek (infile, 0, SEEK_END); // find its size
+      buflen = ftell (infile);
+      fseek (infile, 0, SEEK_SET);
+      buffer = (byte *) arena_alloc (buflen + 1);
+      if (!buffer) {
+         fprintf (stderr, "Unable to allocate %ld bytes for the file\n", buflen);
+         return 1; }
+      fread (buffer, buflen, 1, infile);
+      fclose (infile); }
    if (logparse) fprintf (logfile, "Processing %s, %ld bytes\n", filename, buflen);
 
-   if (!parseonly) { // create the output file
+   if (!parseonly && !scanning) { // create the output file
       miditones_strlcpy (filename, filebasename, MAXPATH);
       if (binaryoutput) {
          miditones_strlcat (filename, ".bin", MAXPATH);
@@ -1701,6 +3410,8 @@ int main (int argc, char *argv[]) {
       if (!outfile) {
          fprintf (stderr, "Unable to open output file %s\n", filename);
          return 1; }
+      char *outfile_buffer = (char *) arena_alloc (OUTFILE_BUFSIZE);
+      if (outfile_buffer) setvbuf (outfile, outfile_buffer, _IOFBF, OUTFILE_BUFSIZE);
       file_header.f1 = (volume_output ? HDR_F1_VOLUME_PRESENT : 0)
                        | (instrumentoutput ? HDR_F1_INSTRUMENTS_PRESENT : 0)
                        | (percussion_translate ? HDR_F1_PERCUSSION_PRESENT : 0);
@@ -1712,8 +3423,8 @@ int main (int argc, char *argv[]) {
          fprintf (outfile, "created by MIDITONES V%s on %s", VERSION,
                   asctime (localtime (&rawtime)));
          print_command_line (outfile, argc, argv);
-         if (channel_mask != 0xffff)
-            fprintf (outfile, "//   Only the masked channels were processed: %04X\n", channel_mask);
+         if (channel_mask != UINT64_MAX)
+            fprintf (outfile, "//   Only the masked channels were processed: %04" PRIX64 "\n", channel_mask);
          if (keyshift != 0)
             fprintf (outfile, "//   Keyshift was %d chromatic notes\n", keyshift);
          if (define_progmem) {
@@ -1738,16 +3449,39 @@ int main (int argc, char *argv[]) {
          outfile_bytecount += sizeof (file_header); } }
 
    // process the MIDI file header
+   start_phase(PHASE_HEADERS);
    hdrptr = buffer;   // point to the file and track headers
    process_file_header ();
    printf ("  Processing %d tracks.\n", num_tracks);
-   if (num_tracks > MAX_TRACKS) midi_error ("Too many tracks", buffer);
+   int midi_tracks = num_tracks;
+   if (split_channels && format_type == 0 && num_tracks == 1) {
+      /* A format 0 file has all the channels in one track, so strategies that work track by track,
+         like -s1 and -s2, can't do anything. Make a virtual track for each channel. They all read
+         the same MIDI track, but each only plays the notes for its channel. */
+      split_format0 = true;
+      num_tracks = NUM_CHANNELS;
+      printf("  Splitting the format 0 track into %d virtual tracks, one for each channel.\n", num_tracks); }
 
    // initialize for processing of all the tracks
+   track = (struct track_status *) arena_alloc(num_tracks * sizeof(struct track_status));
+   queue = (struct queue_entry *) arena_alloc(queue_size * sizeof(struct queue_entry));
+   keys_playing = (struct keys_playing *) arena_alloc((num_tracks + 1) * sizeof(struct keys_playing));
+   if (!track || !queue || !keys_playing) {
+      fprintf (stderr, "Unable to allocate memory for %d tracks\n", num_tracks);
+      return 1; }
+   static const struct track_status empty_track = { 0 };
+   static const struct keys_playing no_keys = { 0 };
+   for (int tracknum = 0; tracknum < num_tracks; ++tracknum) track[tracknum] = empty_track;
+   for (int tracknum = 0; tracknum <= num_tracks; ++tracknum) keys_playing[tracknum] = no_keys;
    tempo = DEFAULT_TEMPO;
+   make_channels(0);
    for (int tracknum = 0; tracknum < num_tracks; ++tracknum) {
       track[tracknum].tempo = DEFAULT_TEMPO;
-      process_track_header (tracknum);
+      track[tracknum].only_channel = split_format0 ? tracknum : -1;
+      if (split_format0 && tracknum > 0) { // another virtual track for the same MIDI track
+         track[tracknum].trkptr = track[0].trkstart;
+         track[tracknum].trkend = track[0].trkend; }
+      else process_track_header (tracknum);
       find_next_note (tracknum);     /* position to the first note on/off */
       /* if we are in "parse only" mode, do the whole track,
          so we do them one at a time instead of time-synchronized. */
@@ -1767,9 +3501,33 @@ int main (int argc, char *argv[]) {
    show_queue_cmd(22, CMD_PLAYNOTE, 109);
    flush_queue();
 #endif
-   if (!parseonly) {
-
+   start_phase(PHASE_CONVERT);
+   if (scanning) { // just profile the song, and maybe estimate the conversion
+      scan_track_data();
+      if (estimate_only) report_estimates();
+      if (scan_only) {
+         FILE *file = scanfile;
+         if (!file) { // we're doing just this file: put the profile next to it
+            miditones_strlcpy (filename, filebasename, MAXPATH);
+            miditones_strlcat (filename, ".scan.csv", MAXPATH);
+            if (!(file = fopen (filename, "w"))) {
+               fprintf (stderr, "Unable to open scan file %s\n", filename);
+               return 1; }
+            write_scan_header(file); }
+         write_scan_rows(file, filebasename, midi_tracks);
+         if (file != scanfile) fclose(file);
+         unsigned average = scan_average(&scan_song);
+         printf("  %d notes, at most %d at once and %u.%03u on average, in %u.%03u seconds with %d tempo changes\n",
+                scan_song.notes, scan_song.peak, average / 1000, average % 1000,
+                (unsigned)(timenow_usec / 1000000), (unsigned)(timenow_usec / 1000 % 1000), tempo_changes); } }
+
+   else if (!parseonly) {
+
+      map_offset = outfile_bytecount; // after the file header
+      if (pipeline && !binaryoutput) emit_start();
       process_track_data();    // do all the tracks interleaved, like a 1950's multiway merge
+      start_phase(PHASE_FINISH);
+      emit_finish();
 
       // generate the ending commentary
       if (!binaryoutput) {
@@ -1777,21 +3535,38 @@ int main (int argc, char *argv[]) {
                  outfile_bytecount, note_on_commands, num_tonegens_used,
                  num_tonegens_used == 1 ? "" : "s");
          if (notes_skipped)
-            fprintf(outfile, "// %d notes had to be skipped\n", notes_skipped); }
+            fprintf(outfile, "// %d notes had to be skipped\n", notes_skipped);
+         if (instrument_limit_drops)
+            fprintf(outfile, "// %d notes had to be skipped because of the instrument limit\n", instrument_limit_drops); }
       printf("  %s %d tone generators were used.\n",
              num_tonegens_used < num_tonegens ? "Only" : "All", num_tonegens_used);
+      if (instrumentoutput)
+         printf("  %d instrument changes were generated.\n", instrument_changes);
       if (notes_skipped)
          printf("  %d notes were skipped because there weren't enough tone generators.\n",
                 notes_skipped);
+      if (max_instruments)
+         printf("  To sound at most %d instruments at once, %d notes were changed to a similar instrument and %d were skipped.\n",
+                max_instruments, instrument_limit_remaps, instrument_limit_drops);
+      if (percussion_notes_released)
+         printf("  %d percussion notes were stopped %u msec after they started\n",
+                percussion_notes_released, (unsigned)(percussionmax_usec / 1000));
+      if (notes_preempted)
+         printf("  %d playing notes were stopped to make room for more important notes.\n", notes_preempted);
+      if (recover_notes)
+         printf("  %d skipped notes were started late when a tone generator became free.\n", notes_recovered);
+      if (consolidate_usec)
+         printf("  %d notes were consolidated, so at the peak %d notes were sounding instead of %d, saving %d tone generators.\n",
+                notes_consolidated, sounding_kept.peak, sounding_all.peak, sounding_all.peak - sounding_kept.peak);
       if (consecutive_delays)
          printf("  %d consecutive delays could be eliminated\n", consecutive_delays);
       if (events_delayed)
-         printf("  %d \"stop note\" commands were delayed because the %d-element output queue is too small\n",
-                events_delayed, QUEUE_SIZE);
+         printf("  %d \"stop note\" commands were delayed because the %d-element output queue is too small (see -queuesize)\n",
+                events_delayed, queue_size);
       if (noteinfo_overflow + noteinfo_notfound > 0)
          printf("  %d notes couldn't be recorded in the track status, so then %d notes couldn't be found\n"
-                "  (Consider recompiling with MAX_TRACKNOTES bigger than %d, to allow more simultaneous notes.)\n",
-                noteinfo_overflow, noteinfo_notfound, MAX_CHANNELNOTES);
+                "  (Consider using -channelnotes bigger than %d, to allow more simultaneous notes.)\n",
+                noteinfo_overflow, noteinfo_notfound, channel_notes);
       printf("  %ld bytes of score data were generated, ", outfile_bytecount);
       printf("representing %u.%03u seconds of music with %d tempo changes\n",
              (unsigned)(timenow_usec / 1000000), (unsigned)(timenow_usec / 1000 % 1000), tempo_changes);
@@ -1804,7 +3579,8 @@ int main (int argc, char *argv[]) {
          fprintf(logfile, "%d stop-notes without start-notes, %d start-notes without stop-notes\n",
                  stopnotes_without_playnotes, playnotes_without_stopnotes);
          if (attacktime_usec > 0) fprintf(logfile, "%d sustain phases done, and %d skipped because the notes were too short\n",
-                                             sustainphases_done, sustainphases_skipped); }
+                                             sustainphases_done, sustainphases_skipped);
+         fprintf(logfile, "%lu bytes of memory were used\n", (unsigned long) arena_in_use); }
       if (0 && do_header) {             // rewrite the file header with the actual number of tone generators used
          if (fseek(outfile, file_header_num_tgens_position, SEEK_SET) != 0)
             fprintf(stderr, "Can't seek to number of tone generators in the header\n");
@@ -1813,9 +3589,1348 @@ int main (int argc, char *argv[]) {
                putc(num_tonegens_used, outfile);
             else
                fprintf(outfile, "%2d", num_tonegens_used); } }
-      fclose(outfile); }
+      fclose(outfile);
+      if (export_events && !write_events(filebasename)) return 1;
+      if (make_map && !write_map(filebasename)) return 1; }
 
    if (loggen || logparse)
       fclose (logfile);
+   outfile = logfile = NULL;
+   buffer = NULL;
+   if (stats) print_stats();
    printf ("  Done.\n");
    return 0; }
+
+/*********************  converting many files  ****************************/
+
+/* With -manifest, we convert all the MIDI files named in a list, and with -shard=i/n,
+   only the ones in the i'th of n shards of the list. Every machine that reads the same
+   manifest computes the same assignment of files to shards, so the shards can be done
+   independently in parallel without talking to each other. Each shard writes a JSON
+   report of what it did, and -mergereports combines those reports into one.
+
+   The manifest has one file name per line. Blank lines and lines starting with # are
+   ignored. A file name may be followed by a tab and the file size in bytes; otherwise
+   we look at the file to find its size.
+
+   Files are assigned to shards by size, largest first, each to the shard that has the
+   fewest bytes so far, which keeps the shards balanced even when a few files are huge.
+   Files of the same size are ordered by a hash of their name, so the assignment doesn't
+   depend on the order of the lines in the manifest. */
+
+struct manifest_entry {
+   char *name;                // the MIDI file name
+   long size;                 // its size in bytes
+   uint32_t hash;             // the hash of its name, to break ties
+   int shard;                 // which shard (1..n) it was assigned to
+   int job;                   // with -jobs, which job (1..n) converts it, if it's in our shard
+} *manifest = NULL;
+int manifest_count = 0;
+
+uint32_t name_hash(const char *name) { // FNV-1a
+   uint32_t hash = 2166136261u;
+   while (*name) hash = (hash ^ (byte) * name++) * 16777619u;
+   return hash; }
+
+int compare_names(const char *a, const char *b) {
+   while (*a && *a == *b) ++a, ++b;
+   return (byte) * a - (byte) * b; }
+
+int compare_manifest_entries(const void *a, const void *b) { // for qsort: biggest first
+   const struct manifest_entry *ea = a, *eb = b;
+   if (ea->size != eb->size) return ea->size > eb->size ? -1 : 1;
+   if (ea->hash != eb->hash) return ea->hash < eb->hash ? -1 : 1;
+   return compare_names(ea->name, eb->name); }
+
+long file_size(const char *name) { // returns -1 if we can't read it
+   char filename[MAXPATH];
+   miditones_strlcpy(filename, name, MAXPATH);
+   int namelen = strlength(filename);
+   if (namelen <= 4 || !(charcmp(filename + namelen - 4, ".mid") || charcmp(filename + namelen - 4, ".MID")))
+      miditones_strlcat(filename, ".mid", MAXPATH);
+   FILE *file = fopen(filename, "rb");
+   if (!file) return -1;
+   fseek(file, 0, SEEK_END);
+   long size = ftell(file);
+   fclose(file);
+   return size; }
+
+/* Give each file to the part, a shard or a job, that has the fewest bytes so far, biggest
+   files first. The shards depend only on the manifest and the number of shards, so -jobs
+   can't change which files a shard has; it only divides our shard among the jobs. */
+void divide_manifest(int parts, int shard) { // shard 0 assigns the shards, otherwise that shard's jobs
+   long *part_bytes = (long *) calloc(parts, sizeof(long));
+   if (!part_bytes) {
+      fprintf(stderr, "Unable to allocate %d shards\n", parts);
+      exit(8); }
+   for (int ndx = 0; ndx < manifest_count; ++ndx) {
+      struct manifest_entry *mp = &manifest[ndx];
+      if (shard && mp->shard != shard) {
+         mp->job = 0;
+         continue; }
+      int smallest = 0;
+      for (int part = 1; part < parts; ++part)
+         if (part_bytes[part] < part_bytes[smallest]) smallest = part;
+      if (shard) mp->job = smallest + 1;
+      else mp->shard = smallest + 1;
+      part_bytes[smallest] += mp->size > 0 ? mp->size : 0; }
+   free(part_bytes); }
+
+void read_manifest(void) { // and assign the files to shards, and our shard's files to jobs
+   char line[MAXPATH + 32];
+   FILE *file = fopen(manifest_name, "r");
+   if (!file) {
+      fprintf(stderr, "Unable to open manifest file %s\n", manifest_name);
+      exit(1); }
+   int allocated = 0;
+   while (fgets(line, sizeof(line), file)) {
+      int len = strlength(line);
+      while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' '))
+         line[--len] = 0;
+      if (len == 0 || line[0] == '#') continue;
+      if (manifest_count >= allocated) {
+         allocated = allocated ? 2 * allocated : 256;
+         manifest = (struct manifest_entry *) realloc(manifest, allocated * sizeof(struct manifest_entry));
+         if (!manifest) {
+            fprintf(stderr, "Unable to allocate the manifest for %d files\n", allocated);
+            exit(8); } }
+      struct manifest_entry *mp = &manifest[manifest_count++];
+      char *tab = line;
+      while (*tab && *tab != '\t') ++tab;
+      if (*tab) { // the size is given
+         *tab = 0;
+         mp->size = atol(tab + 1); }
+      else mp->size = file_size(line);
+      mp->name = (char *) malloc(tab - line + 1);
+      if (!mp->name) {
+         fprintf(stderr, "Unable to allocate the manifest file names\n");
+         exit(8); }
+      miditones_strlcpy(mp->name, line, tab - line + 1);
+      mp->hash = name_hash(mp->name); }
+   fclose(file);
+
+   qsort(manifest, manifest_count, sizeof(struct manifest_entry), compare_manifest_entries);
+   divide_manifest(num_shards, 0);
+   divide_manifest(num_jobs, shard_num); }
+
+void write_json_string(FILE *file, const char *str) {
+   putc('"', file);
+   for (; *str; ++str) {
+      if (*str == '"' || *str == '\\') fprintf(file, "\\%c", *str);
+      else if ((byte) * str < ' ') fprintf(file, "\\u%04X", (byte) * str);
+      else putc(*str, file); }
+   putc('"', file); }
+
+struct report_totals {
+   int files, failed;
+   long bytes, notes, skipped; };
+
+void write_report_totals(FILE *file, struct report_totals *tp) {
+   fprintf(file, " ],\n \"totals\": {\"files\": %d, \"failed\": %d, \"bytes\": %ld, \"notes\": %ld, \"skipped\": %ld}}\n",
+           tp->files, tp->failed, tp->bytes, tp->notes, tp->skipped); }
+
+void shard_file_name(char *name, int shard, int shards, const char *suffix) {
+   sprintf(name, "%.*s.shard-%d-of-%d%s", MAXPATH - 60, manifest_name, shard, shards, suffix); }
+
+void job_file_name(char *name, int job, const char *suffix) { // for the part of our shard done by a job
+   sprintf(name, "%.*s.shard-%d-of-%d.job-%d%s", MAXPATH - 80, manifest_name, shard_num, num_shards, job, suffix); }
+
+/* Convert one file, recovering if it fails, and add a line for it to the report.
+   The name in the report can be different from the name of the file we convert. */
+int convert_and_report(FILE *report, const char *name, const char *basefilename,
+                       struct report_totals *tp, int argc, char *argv[]) { // returns 1 if it failed
+   char filename[MAXPATH];
+   jmp_buf error_return;
+   miditones_strlcpy(filename, basefilename, MAXPATH); // convert_file changes it
+   clock_t start = clock();
+   int failed = 1;
+   conversion_error = &error_return;
+   if (setjmp(error_return) == 0)
+      failed = convert_file(filename, argc, argv);
+   conversion_error = NULL;
+   if (failed) printf("  *** Conversion failed.\n");
+   fprintf(report, "%s  {\"file\": ", tp->files ? ",\n" : "");
+   write_json_string(report, name);
+   fprintf(report, ", \"status\": \"%s\", \"bytes\": %ld, \"notes\": %d, \"tonegens\": %d, \"skipped\": %d, \"msec\": %u, \"cpu_msec\": %ld, \"memory\": %lu",
+           failed ? "failed" : "ok", outfile_bytecount, scan_only ? scan_song.notes : note_on_commands, num_tonegens_used, notes_skipped,
+           (unsigned)(timenow_usec / 1000), (long)((clock() - start) * 1000 / CLOCKS_PER_SEC),
+           (unsigned long) arena_in_use);
+   if (stats) write_json_stats(report);
+   fprintf(report, "}");
+   ++tp->files;
+   tp->failed += failed;
+   tp->bytes += outfile_bytecount;
+   tp->notes += scan_only ? scan_song.notes : note_on_commands;
+   tp->skipped += notes_skipped;
+   return failed; }
+
+// convert the files in our shard of the manifest, or with -jobs one job's part of it, and write its report
+int convert_shard(int job, int argc, char *argv[]) { // returns the number of files that failed
+   char filename[MAXPATH], reportname[MAXPATH];
+   struct report_totals totals = { 0 };
+   int shard = shard_num, shards = num_shards;
+
+   if (job) job_file_name(reportname, job, ".json");
+   else shard_file_name(reportname, shard, shards, ".json");
+   FILE *report = fopen(reportname, "w");
+   if (!report) {
+      fprintf(stderr, "Unable to create report file %s\n", reportname);
+      return 1; }
+   if (scan_only) {
+      if (job) job_file_name(filename, job, ".scan.csv");
+      else shard_file_name(filename, shard, shards, ".scan.csv");
+      if (!(scanfile = fopen(filename, "w"))) {
+         fprintf(stderr, "Unable to create scan file %s\n", filename);
+         fclose(report);
+         return 1; }
+      write_scan_header(scanfile); }
+   fprintf(report, "{\"manifest\": ");
+   write_json_string(report, manifest_name);
+   fprintf(report, ", \"shard\": %d, \"shards\": %d,\n \"files\": [\n", shard, shards);
+   for (int ndx = 0; ndx < manifest_count; ++ndx) {
+      struct manifest_entry *mp = &manifest[ndx];
+      if (mp->shard != shard || (job && mp->job != job)) continue;
+      printf("\n%s (%ld bytes, shard %d of %d)\n", mp->name, mp->size, shard, shards);
+      reset_conversion();
+      convert_and_report(report, mp->name, mp->name, &totals, argc, argv); }
+   reset_conversion(); // close whatever the last file left open
+   fprintf(report, "\n");
+   write_report_totals(report, &totals);
+   fclose(report);
+   if (scanfile) fclose(scanfile);
+   scanfile = NULL;
+   printf("\nShard %d of %d: %d files converted, %d failed; report is in %s\n",
+          shard, shards, totals.files - totals.failed, totals.failed, reportname);
+   printf("At most %lu bytes of memory were used for one file\n", (unsigned long) arena_peak);
+   return totals.failed; }
+
+// find the number after "key": in one of our report lines, or return 0
+long report_field(const char *line, const char *key) {
+   for (; *line; ++line) {
+      const char *lp = line, *kp = key;
+      while (*kp && *lp == *kp) ++lp, ++kp;
+      if (!*kp && lp[0] == '"' && lp[1] == ':') {
+         lp += 2;
+         while (*lp == ' ') ++lp;
+         if (*lp == '"') return lp[1] == 'f'; // "status": 1 if failed
+         return atol(lp); } }
+   return 0; }
+
+// copy the file records of a report into another one, and add them up
+bool copy_report_records(FILE *merged, const char *reportname, struct report_totals *tp) {
+   char line[2 * MAXPATH];
+   FILE *report = fopen(reportname, "r");
+   if (!report) {
+      fprintf(stderr, "Unable to open report file %s\n", reportname);
+      return false; }
+   while (fgets(line, sizeof(line), report)) {
+      int len = strlength(line);
+      while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ','))
+         line[--len] = 0;
+      if (!(line[0] == ' ' && line[1] == ' ' && line[2] == '{')) continue; // not a file record
+      fprintf(merged, "%s%s", tp->files ? ",\n" : "", line);
+      ++tp->files;
+      tp->failed += report_field(line, "status");
+      tp->bytes += report_field(line, "bytes");
+      tp->notes += report_field(line, "notes");
+      tp->skipped += report_field(line, "skipped"); }
+   fclose(report);
+   return true; }
+
+int merge_reports(int numreports, char *reportnames[]) {
+   struct report_totals totals = { 0 };
+   if (numreports <= 0) {
+      fprintf(stderr, "*** -mergereports needs the names of the reports to merge\n");
+      return 4; }
+   FILE *merged = fopen(mergereports_name, "w");
+   if (!merged) {
+      fprintf(stderr, "Unable to create report file %s\n", mergereports_name);
+      return 1; }
+   fprintf(merged, "{\"merged\": %d,\n \"files\": [\n", numreports);
+   for (int rpt = 0; rpt < numreports; ++rpt)
+      if (!copy_report_records(merged, reportnames[rpt], &totals)) {
+         fclose(merged);
+         return 1; }
+   fprintf(merged, "\n");
+   write_report_totals(merged, &totals);
+   fclose(merged);
+   printf("Merged %d reports for %d files, %d of which failed, into %s\n",
+          numreports, totals.files, totals.failed, mergereports_name);
+   return totals.failed ? 1 : 0; }
+
+#ifndef _WIN32
+/* With -jobs=n, we fork n processes that each do part of our shard. The files of the
+   shard were divided among them by size, which keeps them balanced, and each writes a
+   separate report, which we then combine into the report for our shard. */
+int convert_shard_jobs(int argc, char *argv[]) { // returns the number of files that failed
+   char reportname[MAXPATH], partname[MAXPATH], line[2 * MAXPATH];
+   struct report_totals totals = { 0 };
+   fflush(stdout); // so the children don't inherit and repeat our buffered output
+   for (int job = 0; job < num_jobs; ++job) {
+      pid_t pid = fork();
+      if (pid < 0) {
+         fprintf(stderr, "Unable to start job %d\n", job + 1);
+         exit(8); }
+      if (pid == 0) { // not exit(), which would also flush our parent's buffered files
+         int failed = convert_shard(job + 1, argc, argv);
+         fflush(stdout);
+         _exit(failed ? 1 : 0); } }
+   while (wait(NULL) > 0) ;
+
+   shard_file_name(reportname, shard_num, num_shards, ".json");
+   FILE *report = fopen(reportname, "w");
+   if (!report) {
+      fprintf(stderr, "Unable to create report file %s\n", reportname);
+      return 1; }
+   fprintf(report, "{\"manifest\": ");
+   write_json_string(report, manifest_name);
+   fprintf(report, ", \"shard\": %d, \"shards\": %d, \"jobs\": %d,\n \"files\": [\n", shard_num, num_shards, num_jobs);
+   FILE *scan = NULL;
+   if (scan_only) {
+      shard_file_name(partname, shard_num, num_shards, ".scan.csv");
+      if (!(scan = fopen(partname, "w"))) {
+         fprintf(stderr, "Unable to create scan file %s\n", partname);
+         return 1; }
+      write_scan_header(scan); }
+   for (int job = 0; job < num_jobs; ++job) {
+      job_file_name(partname, job + 1, ".json");
+      if (!copy_report_records(report, partname, &totals)) ++totals.failed;
+      remove(partname);
+      if (scan) { // append the job's scan lines, without its header
+         job_file_name(partname, job + 1, ".scan.csv");
+         FILE *part_scan = fopen(partname, "r");
+         if (part_scan) {
+            if (fgets(line, sizeof(line), part_scan))
+               while (fgets(line, sizeof(line), part_scan)) fputs(line, scan);
+            fclose(part_scan);
+            remove(partname); } } }
+   fprintf(report, "\n");
+   write_report_totals(report, &totals);
+   fclose(report);
+   if (scan) fclose(scan);
+   printf("\nShard %d of %d, in %d jobs: %d files converted, %d failed; report is in %s\n",
+          shard_num, num_shards, num_jobs, totals.files - totals.failed, totals.failed, reportname);
+   return totals.failed; }
+#endif
+
+int convert_manifest(int argc, char *argv[]) { // returns the number of files that failed
+   read_manifest();
+#ifndef _WIN32
+   if (num_jobs > 1) return convert_shard_jobs(argc, argv);
+#endif
+   return convert_shard(0, argc, argv); }
+
+/*********************  converting the files in an archive  ****************************/
+
+/* With -tar, we convert the MIDI files in a tar archive without first extracting them
+   to disk. We read the archive as a stream, from standard input if its name is "-", and
+   if it was compressed with gzip we read it through "gzip -dc". Each member whose name
+   ends with .mid is read into memory and converted from there. The output files are
+   written under the -outdir directory (or the current directory) with the path the
+   member had, or with -outtar they are put into a new tar archive and removed. With
+   -jobs=n, n members are converted at once by separate processes. The report, in the
+   same form as for -manifest, is written to <archive>.json. */
+
+#define TAR_BLOCKSIZE 512
+const char *output_suffixes[] = {".c", ".h", ".bin", ".log", ".scan.csv", ".events", ".map", NULL };
+
+unsigned long tar_number(const char *field, int len) { // octal, or binary if the top bit is set
+   unsigned long value = 0;
+   if (*field & 0x80) {
+      for (int i = 1; i < len; ++i) value = (value << 8) | (byte) field[i];
+      return value; }
+   for (; len > 0 && (*field == ' ' || *field == '0'); ++field, --len) ;
+   for (; len > 0 && *field >= '0' && *field <= '7'; ++field, --len)
+      value = (value << 3) | (*field - '0');
+   return value; }
+
+bool tar_read(FILE *archive, void *data, unsigned long length) {
+   return fread(data, 1, length, archive) == length; }
+
+bool tar_read_data(FILE *archive, void *data, unsigned long length) { // and skip the padding after it
+   char padding[TAR_BLOCKSIZE];
+   return tar_read(archive, data, length)
+          && tar_read(archive, padding, (TAR_BLOCKSIZE - length % TAR_BLOCKSIZE) % TAR_BLOCKSIZE); }
+
+bool tar_skip(FILE *archive, unsigned long length) { // skip data and its padding; we might not be able to seek
+   char block[TAR_BLOCKSIZE];
+   length = (length + TAR_BLOCKSIZE - 1) / TAR_BLOCKSIZE * TAR_BLOCKSIZE;
+   for (; length > 0; length -= TAR_BLOCKSIZE)
+      if (!tar_read(archive, block, TAR_BLOCKSIZE)) return false;
+   return true; }
+
+/* Find the next regular file in the archive, and return its name and size. The GNU and
+   POSIX ways of recording long names are understood; everything else is skipped. */
+bool tar_next_member(FILE *archive, char *name, unsigned long *size) {
+   char header[TAR_BLOCKSIZE], longname[MAXPATH] = "";
+   while (tar_read(archive, header, TAR_BLOCKSIZE)) {
+      if (header[0] == 0) return false; // the end of the archive
+      char type = header[156];
+      *size = tar_number(header + 124, 12);
+      if (type == 'L' || type == 'x') { // the name of the next member, GNU or POSIX style
+         char *data = (char *) arena_alloc(*size + 1);
+         if (!data || !tar_read_data(archive, data, *size)) return false;
+         data[*size] = 0;
+         if (type == 'L') miditones_strlcpy(longname, data, MAXPATH);
+         else for (char *rec = data; rec < data + *size; ) { // "<length> <key>=<value>\n" records
+               long reclen = atol(rec);
+               if (reclen <= 0) break;
+               char *key = rec;
+               while (key < rec + reclen && *key != ' ') ++key;
+               if (key + 6 < rec + reclen && charcmp(key + 1, "path=")) {
+                  int namelen = rec + reclen - (key + 6) - 1; // not the newline
+                  if (namelen >= MAXPATH) namelen = MAXPATH - 1;
+                  for (int i = 0; i < namelen; ++i) longname[i] = key[6 + i];
+                  longname[namelen] = 0; }
+               rec += reclen; }
+         continue; }
+      if (type != '0' && type != 0 && type != '7') { // not a regular file
+         if (!tar_skip(archive, *size)) return false;
+         longname[0] = 0;
+         continue; }
+      if (longname[0]) miditones_strlcpy(name, longname, MAXPATH);
+      else { // the ustar prefix, if any, and the name, neither of which need be terminated
+         int len = 0;
+         if (memcmp(header + 257, "ustar", 5) == 0 && header[345])
+            for (int i = 0; i < 155 && header[345 + i]; ++i) name[len++] = header[345 + i];
+         if (len) name[len++] = '/';
+         for (int i = 0; i < 100 && header[i]; ++i) name[len++] = header[i];
+         name[len] = 0; }
+      return true; }
+   return false; }
+
+// is this a member we can safely write the output files for, under the output directory?
+bool safe_member_name(const char *name) {
+   if (name[0] == '/' || name[0] == '\\' || (name[0] && name[1] == ':')) return false;
+   for (const char *p = name; *p; ++p)
+      if (p[0] == '.' && p[1] == '.' && (p == name || p[-1] == '/' || p[-1] == '\\')
+            && (p[2] == 0 || p[2] == '/' || p[2] == '\\')) return false;
+   return true; }
+
+bool midi_member_name(const char *name) {
+   int len = strlength(name);
+   return len > 4 && (charcmp(name + len - 4, ".mid") || charcmp(name + len - 4, ".MID")); }
+
+void make_parent_directories(const char *path) { // for the output files of a member
+   char dir[MAXPATH];
+   miditones_strlcpy(dir, path, MAXPATH);
+   for (char *p = dir + 1; *p; ++p)
+      if (*p == '/' || *p == '\\') {
+         char sep = *p;
+         *p = 0;
+#ifdef _WIN32
+         _mkdir(dir); // it doesn't matter if it already exists
+#else
+         mkdir(dir, 0777);
+#endif
+         *p = sep; } }
+
+FILE *open_archive(const char *name, bool *piped) {
+   *piped = false;
+   if (strcmp(name, "-") == 0) return stdin;
+   FILE *archive = fopen(name, "rb");
+   if (!archive) return NULL;
+   int byte1 = getc(archive), byte2 = getc(archive);
+   if (byte1 == 0x1f && byte2 == 0x8b) { // gzip's magic number
+      char command[2 * MAXPATH + 20];
+      int len = 0;
+      fclose(archive);
+#ifdef _WIN32
+      len = snprintf(command, sizeof(command), "gzip -dc \"%s\"", name);
+#else
+      len = snprintf(command, sizeof(command), "gzip -dc '");
+      for (const char *p = name; *p && len < sizeof(command) - 8; ++p) // quote the quotes
+         len += *p == '\'' ? snprintf(command + len, 5, "'\\''") : snprintf(command + len, 2, "%c", *p);
+      snprintf(command + len, sizeof(command) - len, "'");
+#endif
+      *piped = true;
+      return popen(command, "r"); }
+   rewind(archive);
+   return archive; }
+
+void tar_finish_header(FILE *outtar, char *header, unsigned long size, char type) { // the name is in it
+   sprintf(header + 100, "%07o", 0644);
+   sprintf(header + 108, "%07o", 0);
+   sprintf(header + 116, "%07o", 0);
+   sprintf(header + 124, "%011lo", size);
+   sprintf(header + 136, "%011lo", (unsigned long) time(NULL));
+   header[156] = type;
+   memcpy(header + 257, "ustar", 6);
+   memcpy(header + 263, "00", 2);
+   memset(header + 148, ' ', 8); // the checksum is computed with its own field as blanks
+   unsigned checksum = 0;
+   for (int i = 0; i < TAR_BLOCKSIZE; ++i) checksum += (byte) header[i];
+   sprintf(header + 148, "%06o", checksum);
+   fwrite(header, 1, TAR_BLOCKSIZE, outtar); }
+
+/* Write the header for a member. A name over 100 characters is split at a '/' between the
+   ustar prefix and name fields if it can be. Otherwise the whole name goes into a GNU "long
+   name" member just before, as tar_next_member, GNU tar and bsdtar all understand. */
+void tar_write_header(FILE *outtar, const char *name, unsigned long size) {
+   char header[TAR_BLOCKSIZE] = { 0 };
+   int len = strlength(name), split = 0;
+   if (len > 100) { // put the directories into the ustar prefix
+      for (split = len - 101; split < len && name[split] != '/'; ++split) ;
+      if (split >= len || split > 155) split = 0; }
+   if (len > 100 && !split) {
+      memcpy(header, "././@LongLink", 13);
+      tar_finish_header(outtar, header, len + 1, 'L');
+      memset(header, 0, TAR_BLOCKSIZE);
+      fwrite(name, 1, len + 1, outtar); // with its terminating null
+      if ((len + 1) % TAR_BLOCKSIZE) fwrite(header, 1, TAR_BLOCKSIZE - (len + 1) % TAR_BLOCKSIZE, outtar); }
+   if (split) {
+      memcpy(header + 345, name, split);
+      memcpy(header, name + split + 1, len - split - 1); }
+   else memcpy(header, name, len > 100 ? 100 : len); // the long name member has all of it
+   tar_finish_header(outtar, header, size, '0'); }
+
+// move the output files for a member, if there are any, into the output archive
+void tar_add_outputs(FILE *outtar, const char *membername, const char *basefilename) {
+   char filename[MAXPATH], name[MAXPATH], data[8192];
+   for (int sfx = 0; output_suffixes[sfx]; ++sfx) {
+      miditones_strlcpy(filename, basefilename, MAXPATH);
+      miditones_strlcat(filename, output_suffixes[sfx], MAXPATH);
+      FILE *file = fopen(filename, "rb");
+      if (!file) continue;
+      fseek(file, 0, SEEK_END);
+      unsigned long size = ftell(file), done = 0;
+      rewind(file);
+      miditones_strlcpy(name, membername, MAXPATH);
+      miditones_strlcat(name, output_suffixes[sfx], MAXPATH);
+      tar_write_header(outtar, name, size);
+      for (size_t got; done < size && (got = fread(data, 1, sizeof(data), file)) > 0; done += got)
+         fwrite(data, 1, got, outtar);
+      memset(data, 0, TAR_BLOCKSIZE);
+      for (; done < size; done += TAR_BLOCKSIZE) fwrite(data, 1, TAR_BLOCKSIZE, outtar); // it shrank?
+      if (size % TAR_BLOCKSIZE) fwrite(data, 1, TAR_BLOCKSIZE - size % TAR_BLOCKSIZE, outtar);
+      fclose(file);
+      remove(filename); } }
+
+// remove what a failed conversion of a member wrote, instead of adding it to the output archive
+void remove_outputs(const char *basefilename) {
+   char filename[MAXPATH];
+   for (int sfx = 0; output_suffixes[sfx]; ++sfx) {
+      miditones_strlcpy(filename, basefilename, MAXPATH);
+      miditones_strlcat(filename, output_suffixes[sfx], MAXPATH);
+      remove(filename); } }
+
+// a report line for a member whose job ended without writing one
+void report_unconverted(FILE *report, const char *name, struct report_totals *tp) {
+   fprintf(report, "%s  {\"file\": ", tp->files ? ",\n" : "");
+   write_json_string(report, name);
+   fprintf(report, ", \"status\": \"failed\", \"bytes\": 0, \"notes\": 0, \"tonegens\": 0, \"skipped\": 0}");
+   ++tp->files;
+   ++tp->failed; }
+
+// the names for a member: in the report and output archive, and on disk
+void member_names(const char *member, char *membername, char *basefilename) {
+   miditones_strlcpy(membername, member, MAXPATH);
+   membername[strlength(membername) - 4] = 0; // without .mid
+   basefilename[0] = 0;
+   if (outdir_name) {
+      miditones_strlcpy(basefilename, outdir_name, MAXPATH);
+      miditones_strlcat(basefilename, "/", MAXPATH); }
+   miditones_strlcat(basefilename, membername, MAXPATH); }
+
+#ifndef _WIN32
+struct archive_job {            // a process converting one member of the archive
+   pid_t pid;                   // 0 if this job slot is free
+   char member[MAXPATH], membername[MAXPATH], basefilename[MAXPATH];
+} *archive_jobs = NULL;
+
+#define JOB_FAILED 1            // exit status of a job whose conversion failed, which it reported
+#define JOB_UNREPORTED 2        // ...or that couldn't write its line of the report
+
+void archive_job_name(char *name, int job) { // where a job process writes its lines of the report
+   snprintf(name, MAXPATH, "%s.job-%d.json", tar_name, job + 1); }
+
+/* Wait for one of our jobs to finish. We ask about each job's process by its pid, because
+   waiting for any child could instead collect the gzip that is reading the archive, which
+   pclose() needs to wait for itself. Only a job that converted its member adds the output
+   files to the output archive; any other job's are deleted, and if it died without writing
+   its line of the report, we write one for it. */
+int wait_for_archive_job(FILE *outtar, FILE *report, struct report_totals *tp) { // returns the slot that finished, or -1 if none were running
+   struct timespec pause = { 0, 1000000 }; // 1 msec between looks
+   while (true) {
+      int running = 0;
+      for (int job = 0; job < num_jobs; ++job) {
+         struct archive_job *jp = &archive_jobs[job];
+         int status;
+         if (!jp->pid) continue;
+         pid_t pid = waitpid(jp->pid, &status, WNOHANG);
+         if (pid == 0) { // still running
+            ++running;
+            continue; }
+         int result = pid < 0 || !WIFEXITED(status) ? JOB_UNREPORTED : WEXITSTATUS(status);
+         if (result != 0 && result != JOB_FAILED) {
+            fprintf(stderr, "*** The job converting %s ended without reporting\n", jp->member);
+            report_unconverted(report, jp->member, tp); }
+         if (outtar && result == 0) tar_add_outputs(outtar, jp->membername, jp->basefilename);
+         else if (outtar) remove_outputs(jp->basefilename);
+         jp->pid = 0;
+         return job; }
+      if (!running) return -1;
+      nanosleep(&pause, NULL); } }
+#endif
+
+int convert_archive(int argc, char *argv[]) { // returns the number of files that failed
+   char member[MAXPATH], membername[MAXPATH], basefilename[MAXPATH], reportname[MAXPATH];
+   struct report_totals totals = { 0 };
+   unsigned long size;
+   bool piped;
+   FILE *outtar = NULL;
+
+   FILE *archive = open_archive(tar_name, &piped);
+   if (!archive) {
+      fprintf(stderr, "Unable to open archive %s\n", tar_name);
+      return 1; }
+   if (outtar_name && !(outtar = fopen(outtar_name, "wb"))) {
+      fprintf(stderr, "Unable to create archive %s\n", outtar_name);
+      return 1; }
+   miditones_strlcpy(reportname, strcmp(tar_name, "-") == 0 ? "stdin" : tar_name, MAXPATH);
+   miditones_strlcat(reportname, ".json", MAXPATH);
+   FILE *report = fopen(reportname, "w");
+   if (!report) {
+      fprintf(stderr, "Unable to create report file %s\n", reportname);
+      return 1; }
+   fprintf(report, "{\"archive\": ");
+   write_json_string(report, tar_name);
+   fprintf(report, ",\n \"files\": [\n");
+#ifndef _WIN32
+   if (num_jobs > 1) {
+      archive_jobs = (struct archive_job *) calloc(num_jobs, sizeof(struct archive_job));
+      assert(archive_jobs != NULL, "can't allocate the job table");
+      for (int job = 0; job < num_jobs; ++job) { // start with empty job reports
+         archive_job_name(reportname, job);
+         remove(reportname); } }
+#endif
+
+   reset_conversion();
+   while (tar_next_member(archive, member, &size)) {
+      if (!midi_member_name(member) || !safe_member_name(member)) {
+         if (midi_member_name(member)) printf("\nSkipping %s, because of where it would be written\n", member);
+         if (!tar_skip(archive, size)) break;
+         reset_conversion(); // forget any long name we read
+         continue; }
+      reset_conversion();
+      input_data = (uint8_t *) arena_alloc(size + 1);
+      if (!input_data || !tar_read_data(archive, input_data, size)) {
+         fprintf(stderr, "Unable to read %s from the archive\n", member);
+         break; }
+      input_length = size;
+      member_names(member, membername, basefilename);
+      make_parent_directories(basefilename);
+#ifndef _WIN32
+      if (num_jobs > 1) {
+         int job;
+         for (job = 0; job < num_jobs && archive_jobs[job].pid; ++job) ;
+         if (job >= num_jobs) job = wait_for_archive_job(outtar, report, &totals);
+         if (job < 0) break;
+         fflush(stdout); // so the child doesn't repeat our buffered output
+         pid_t pid = fork();
+         if (pid < 0) {
+            fprintf(stderr, "Unable to start a job for %s\n", member);
+            exit(8); }
+         if (pid == 0) { // the child converts the member, and adds a line to its job's report
+            struct report_totals job_totals = { 0 };
+            archive_job_name(reportname, job);
+            FILE *job_report = fopen(reportname, "a");
+            if (!job_report) _exit(JOB_UNREPORTED); // not exit(), which would also flush or reposition our parent's files
+            printf("\n%s (%lu bytes, job %d)\n", member, size, job + 1);
+            int failed = convert_and_report(job_report, member, basefilename, &job_totals, argc, argv);
+            fprintf(job_report, "\n");
+            fclose(job_report);
+            reset_conversion();
+            fflush(stdout);
+            _exit(failed ? JOB_FAILED : 0); }
+         archive_jobs[job].pid = pid;
+         miditones_strlcpy(archive_jobs[job].member, member, MAXPATH);
+         miditones_strlcpy(archive_jobs[job].membername, membername, MAXPATH);
+         miditones_strlcpy(archive_jobs[job].basefilename, basefilename, MAXPATH);
+         continue; }
+#endif
+      printf("\n%s (%lu bytes)\n", member, size);
+      int failed = convert_and_report(report, member, basefilename, &totals, argc, argv);
+      reset_conversion(); // close the output files, so we can move them
+      if (outtar && !failed) tar_add_outputs(outtar, membername, basefilename);
+      else if (outtar) remove_outputs(basefilename); }
+
+#ifndef _WIN32
+   if (num_jobs > 1) { // wait for the last ones, then collect the lines of the job reports
+      while (wait_for_archive_job(outtar, report, &totals) >= 0) ;
+      for (int job = 0; job < num_jobs; ++job) {
+         archive_job_name(reportname, job);
+         FILE *job_report = fopen(reportname, "r");
+         if (!job_report) continue;
+         fclose(job_report);
+         copy_report_records(report, reportname, &totals);
+         remove(reportname); } }
+#endif
+   reset_conversion();
+   if (piped) pclose(archive);
+   else if (archive != stdin) fclose(archive);
+   if (outtar) {
+      char block[2 * TAR_BLOCKSIZE] = { 0 }; // the end of the archive
+      fwrite(block, 1, sizeof(block), outtar);
+      fclose(outtar); }
+   fprintf(report, "\n");
+   write_report_totals(report, &totals);
+   fclose(report);
+   miditones_strlcpy(reportname, strcmp(tar_name, "-") == 0 ? "stdin" : tar_name, MAXPATH);
+   miditones_strlcat(reportname, ".json", MAXPATH);
+   printf("\n%d files in the archive converted, %d failed; report is in %s\n",
+          totals.files - totals.failed, totals.failed, reportname);
+   return totals.failed; }
+
+/*********************  working with existing bytestreams  ****************************/
+
+/* These read .bin files that were already made, for when the MIDI file isn't at hand or
+   when we want to compare the results of two conversions. The volume bytes are expected
+   if the file header says so, or if there is no header and -v was given. */
+
+#define BYTESTREAM_DELAY 0      // what next_command() returns for a delay
+
+struct bytestream {
+   const char *name;
+   byte *data, *ptr, *end;      // the whole file, where we are, and its end
+   struct file_hdr_t header;    // its header, or one made up from the options if it has none
+   bool has_header, volume;
+   bool bad;                    // we found an error in it
+   unsigned long time_msec;     // the time of the next command, in msec from the start
+};
+
+struct bytestream_command {
+   byte cmd, tgnum;             // CMD_PLAYNOTE, CMD_STOPNOTE, CMD_INSTRUMENT, CMD_STOP, CMD_RESTART, or a delay
+   byte note, volume, instrument;
+   unsigned delay_msec;
+   byte *position; };           // where it is in the file
+
+bool read_bytestream(struct bytestream *bs, const char *name) { // returns false if we can't
+   FILE *file = fopen(name, "rb");
+   bs->name = name;
+   if (!file) {
+      fprintf(stderr, "Unable to open bytestream file %s\n", name);
+      return false; }
+   fseek (file, 0, SEEK_END);
+   long length = ftell (file);
+   fseek (file, 0, SEEK_SET);
+   bs->data = (byte *) arena_alloc (length > 0 ? length : 1);
+   if (!bs->data || fread(bs->data, 1, length, file) != length) {
+      fprintf(stderr, "Unable to read bytestream file %s\n", name);
+      fclose(file);
+      return false; }
+   fclose(file);
+   bs->ptr = bs->data;
+   bs->end = bs->data + length;
+   bs->time_msec = 0;
+   bs->bad = false;
+   bs->has_header = length >= sizeof(struct file_hdr_t) && bs->data[0] == 'P' && bs->data[1] == 't'
+                    && bs->data[2] >= sizeof(struct file_hdr_t) && bs->data[2] <= length;
+   if (bs->has_header) {
+      memcpy(&bs->header, bs->data, sizeof(struct file_hdr_t));
+      bs->ptr += bs->header.hdr_length; }
+   else {
+      bs->header = file_header;
+      bs->header.f1 = (volume_output ? HDR_F1_VOLUME_PRESENT : 0) | (instrumentoutput ? HDR_F1_INSTRUMENTS_PRESENT : 0); }
+   bs->volume = bs->header.f1 & HDR_F1_VOLUME_PRESENT;
+   return true; }
+
+bool next_command(struct bytestream *bs, struct bytestream_command *cp) { // returns false at the end
+   if (bs->ptr >= bs->end) return false;
+   cp->position = bs->ptr;
+   byte cmd = *bs->ptr++;
+   int needed = cmd < 0x80 ? 1 : (cmd & 0xf0) == CMD_PLAYNOTE ? (bs->volume ? 2 : 1)
+                : (cmd & 0xf0) == CMD_INSTRUMENT ? 1 : 0;
+   if (bs->end - bs->ptr < needed) {
+      fprintf(stderr, "%s: the command at %04lX is cut off\n", bs->name, (unsigned long)(cp->position - bs->data));
+      bs->bad = true;
+      return false; }
+   cp->tgnum = cmd & 0x0f;
+   cp->cmd = cmd < 0x80 ? BYTESTREAM_DELAY : cmd & 0xf0;
+   switch (cp->cmd) {
+   case BYTESTREAM_DELAY:
+      cp->delay_msec = ((unsigned)cmd << 8) | *bs->ptr++;
+      bs->time_msec += cp->delay_msec;
+      break;
+   case CMD_PLAYNOTE:
+      cp->note = *bs->ptr++;
+      cp->volume = bs->volume ? *bs->ptr++ : 127;
+      break;
+   case CMD_INSTRUMENT:
+      cp->instrument = *bs->ptr++;
+      break;
+   case CMD_STOPNOTE:
+   case CMD_STOP:
+   case CMD_RESTART:
+      break;
+   default:
+      fprintf(stderr, "%s: unknown command %02X at %04lX\n", bs->name, cmd, (unsigned long)(cp->position - bs->data));
+      bs->bad = true;
+      return false; }
+   return true; }
+
+/* -diff compares two bytestreams as music rather than as bytes, so that it doesn't matter
+   which tone generators play the notes. Each is decoded into notes with a start and end time,
+   pitch, volume and instrument. The notes are sorted by pitch and instrument and then time,
+   and notes of the same pitch and instrument may be paired up if they start within -difftime
+   msec of each other. The unpaired ones were removed or added; paired ones may have been
+   shifted, truncated, lengthened or changed in volume. A note that is replayed on the same
+   generator without a stop, like a sustain phase, ends the previous note there and starts a
+   new one.
+
+   Pairing each note with the first one that is close enough goes wrong for repeated notes:
+   if the old notes are at 0, 40, 80 and 120 msec and the new ones at 40, 80 and 120, that
+   would shift three notes and remove the one at 120, instead of just removing the one at 0.
+   So we break the notes of each pitch and instrument into clusters separated by gaps of more
+   than -difftime, which can't have pairs across them, and pair the notes of each cluster with
+   a small dynamic program that makes the most pairs, and among those, the ones that moved the
+   least. Clusters are usually a few notes; one too big for that is paired first-come. */
+
+struct decoded_note {
+   uint32_t start_msec, end_msec;
+   uint32_t order;              // to keep the sort stable
+   byte note, volume, instrument; };
+
+struct decoded_notes {
+   struct decoded_note *notes;
+   unsigned long count, room; };
+
+void add_decoded_note(struct decoded_notes *dp, struct decoded_note *np) {
+   if (dp->count >= dp->room) { // make room for more: double it
+      unsigned long room = dp->room ? 2 * dp->room : 4096;
+      dp->notes = (struct decoded_note *) arena_grow(dp->notes,
+                  dp->room * sizeof(struct decoded_note), room * sizeof(struct decoded_note));
+      if (!dp->notes) out_of_memory("notes", room);
+      dp->room = room; }
+   np->order = dp->count;
+   dp->notes[dp->count++] = *np; }
+
+bool decode_notes(const char *name, struct decoded_notes *dp) { // returns false if we can't
+   struct bytestream bs;
+   struct bytestream_command command;
+   struct decoded_note playing[16];
+   bool is_playing[16] = { false };
+   byte instrument[16] = { 0 };
+   if (!read_bytestream(&bs, name)) return false;
+   dp->notes = NULL;
+   dp->count = dp->room = 0;
+   while (next_command(&bs, &command)) {
+      int tgnum = command.tgnum;
+      if (command.cmd == BYTESTREAM_DELAY) continue;
+      if (command.cmd == CMD_INSTRUMENT) instrument[tgnum] = command.instrument;
+      if (command.cmd == CMD_PLAYNOTE || command.cmd == CMD_STOPNOTE) {
+         if (is_playing[tgnum]) { // it ends now
+            playing[tgnum].end_msec = bs.time_msec;
+            add_decoded_note(dp, &playing[tgnum]);
+            is_playing[tgnum] = false; }
+         if (command.cmd == CMD_PLAYNOTE) {
+            struct decoded_note *np = &playing[tgnum];
+            np->start_msec = bs.time_msec;
+            np->note = command.note;
+            np->volume = command.volume;
+            np->instrument = instrument[tgnum];
+            is_playing[tgnum] = true; } }
+      if (command.cmd == CMD_STOP || command.cmd == CMD_RESTART) break; }
+   if (bs.bad) return false;
+   for (int tgnum = 0; tgnum < 16; ++tgnum)
+      if (is_playing[tgnum]) { // anything still playing ends at the end of the score
+         playing[tgnum].end_msec = bs.time_msec;
+         add_decoded_note(dp, &playing[tgnum]); }
+   return true; }
+
+int compare_decoded_notes(const void *a, const void *b) { // by pitch, instrument and then time
+   const struct decoded_note *na = (const struct decoded_note *) a, *nb = (const struct decoded_note *) b;
+   if (na->note != nb->note) return na->note < nb->note ? -1 : 1;
+   if (na->instrument != nb->instrument) return na->instrument < nb->instrument ? -1 : 1;
+   if (na->start_msec != nb->start_msec) return na->start_msec < nb->start_msec ? -1 : 1;
+   return na->order < nb->order ? -1 : na->order > nb->order; }
+
+enum diff_kind { DIFF_REMOVED, DIFF_ADDED, DIFF_SHIFTED, DIFF_TRUNCATED, DIFF_LENGTHENED, DIFF_VOLUME, NUM_DIFF_KINDS };
+const char *diff_kind_names[NUM_DIFF_KINDS] = { "removed", "added", "shifted", "truncated", "lengthened", "volume" };
+
+struct difference {
+   enum diff_kind kind;
+   unsigned long order;         // to keep the sort stable
+   struct decoded_note *old, *new; }; // either may be NULL
+
+struct differences {
+   struct difference *list;
+   unsigned long count, room;
+   unsigned long counts[NUM_DIFF_KINDS]; };
+
+void add_difference(struct differences *dp, enum diff_kind kind, struct decoded_note *old, struct decoded_note *new) {
+   if (dp->count >= dp->room) {
+      unsigned long room = dp->room ? 2 * dp->room : 1024;
+      dp->list = (struct difference *) arena_grow(dp->list,
+                 dp->room * sizeof(struct difference), room * sizeof(struct difference));
+      if (!dp->list) out_of_memory("differences", room);
+      dp->room = room; }
+   struct difference *dp_new = &dp->list[dp->count++];
+   dp_new->kind = kind;
+   dp_new->order = dp->count;
+   dp_new->old = old;
+   dp_new->new = new;
+   ++dp->counts[kind]; }
+
+uint32_t difference_time(const struct difference *dp) {
+   return dp->old ? dp->old->start_msec : dp->new->start_msec; }
+
+int compare_differences(const void *a, const void *b) { // by time, then in the order they were found
+   const struct difference *da = (const struct difference *) a, *db = (const struct difference *) b;
+   uint32_t ta = difference_time(da), tb = difference_time(db);
+   if (ta != tb) return ta < tb ? -1 : 1;
+   return da->order < db->order ? -1 : da->order > db->order; }
+
+void print_difference(struct difference *dp) {
+   struct decoded_note *np = dp->old ? dp->old : dp->new;
+   uint32_t time = difference_time(dp);
+   printf("%6u.%03u %-10s note %3d instrument %3d", time / 1000, time % 1000,
+          diff_kind_names[dp->kind], np->note, np->instrument);
+   switch (dp->kind) {
+   case DIFF_REMOVED: case DIFF_ADDED:
+      printf(" volume %3d, for %u msec\n", np->volume, np->end_msec - np->start_msec);
+      break;
+   case DIFF_SHIFTED:
+      printf(", starting %+ld msec later\n", (long)dp->new->start_msec - (long)dp->old->start_msec);
+      break;
+   case DIFF_TRUNCATED: case DIFF_LENGTHENED:
+      printf(", playing for %u msec instead of %u\n", dp->new->end_msec - dp->new->start_msec,
+             dp->old->end_msec - dp->old->start_msec);
+      break;
+   case DIFF_VOLUME:
+      printf(", volume %d instead of %d\n", dp->new->volume, dp->old->volume);
+      break;
+   default: break; } }
+
+void add_pair_differences(struct differences *dp, struct decoded_note *op, struct decoded_note *np,
+                          unsigned long *same) { // they are the same note; what changed?
+   bool changed = false;
+   if (op->start_msec != np->start_msec) {
+      add_difference(dp, DIFF_SHIFTED, op, np);
+      changed = true; }
+   if (np->end_msec - np->start_msec != op->end_msec - op->start_msec) {
+      add_difference(dp, np->end_msec - np->start_msec < op->end_msec - op->start_msec
+                     ? DIFF_TRUNCATED : DIFF_LENGTHENED, op, np);
+      changed = true; }
+   if (op->volume != np->volume) {
+      add_difference(dp, DIFF_VOLUME, op, np);
+      changed = true; }
+   if (!changed) ++*same; }
+
+bool notes_pairable(struct decoded_note *op, struct decoded_note *np) {
+   return op->start_msec <= np->start_msec + diff_msec && np->start_msec <= op->start_msec + diff_msec; }
+
+#define DIFF_CLUSTER_MAX (1 << 22) // the most old*new notes in a cluster for the dynamic program
+#define DIFF_PAIR_SCORE ((int64_t)1 << 40) // a pair counts for more than any total of shifts
+
+/* Pair the old and new notes of one cluster. score[i][j] is the best for the first i old and
+   j new notes: DIFF_PAIR_SCORE for each pair, less the msec each paired note was shifted. */
+void pair_cluster(struct differences *dp, struct decoded_note *old, unsigned long nold,
+                  struct decoded_note *new, unsigned long nnew, unsigned long *same,
+                  int64_t **table, unsigned long *room) {
+   unsigned long width = nnew + 1;
+   if ((nold + 1) * width > *room) {
+      unsigned long newroom = (nold + 1) * width;
+      *table = (int64_t *) arena_grow(*table, *room * sizeof(int64_t), newroom * sizeof(int64_t));
+      if (!*table) {
+         fprintf(stderr, "Unable to allocate memory to pair %lu notes with %lu\n", nold, nnew);
+         exit(8); }
+      *room = newroom; }
+   int64_t *score = *table;
+   for (unsigned long i = 0; i <= nold; ++i)
+      for (unsigned long j = 0; j <= nnew; ++j) {
+         int64_t best = 0;
+         if (i > 0 && score[(i - 1) * width + j] > best) best = score[(i - 1) * width + j];
+         if (j > 0 && score[i * width + j - 1] > best) best = score[i * width + j - 1];
+         if (i > 0 && j > 0 && notes_pairable(&old[i - 1], &new[j - 1])) {
+            int64_t paired = score[(i - 1) * width + j - 1] + DIFF_PAIR_SCORE
+                             - labs((long)old[i - 1].start_msec - (long)new[j - 1].start_msec);
+            if (paired > best) best = paired; }
+         score[i * width + j] = best; }
+   for (unsigned long i = nold, j = nnew; i > 0 || j > 0;) { // retrace the best choices
+      if (i > 0 && score[i * width + j] == score[(i - 1) * width + j]) {
+         add_difference(dp, DIFF_REMOVED, &old[--i], NULL); }
+      else if (j > 0 && score[i * width + j] == score[i * width + j - 1]) {
+         add_difference(dp, DIFF_ADDED, NULL, &new[--j]); }
+      else {
+         --i, --j;
+         add_pair_differences(dp, &old[i], &new[j], same); } } }
+
+void pair_cluster_first_come(struct differences *dp, struct decoded_note *old, unsigned long nold,
+                             struct decoded_note *new, unsigned long nnew, unsigned long *same) {
+   unsigned long i = 0, j = 0;
+   while (i < nold || j < nnew) {
+      if (j >= nnew || (i < nold && old[i].start_msec + diff_msec < new[j].start_msec))
+         add_difference(dp, DIFF_REMOVED, &old[i++], NULL);
+      else if (i >= nold || new[j].start_msec + diff_msec < old[i].start_msec)
+         add_difference(dp, DIFF_ADDED, NULL, &new[j++]);
+      else {
+         add_pair_differences(dp, &old[i], &new[j], same);
+         ++i, ++j; } } }
+
+int diff_bytestreams(const char *oldname, const char *newname) { // returns 0 if they are the same music
+   struct decoded_notes old, new;
+   struct differences diffs = { 0 };
+   int64_t *table = NULL;
+   unsigned long table_room = 0;
+   if (!decode_notes(oldname, &old) || !decode_notes(newname, &new)) return 2;
+   qsort(old.notes, old.count, sizeof(struct decoded_note), compare_decoded_notes);
+   qsort(new.notes, new.count, sizeof(struct decoded_note), compare_decoded_notes);
+   unsigned long oldndx = 0, newndx = 0, same = 0;
+   while (oldndx < old.count || newndx < new.count) {
+      // find the next cluster: notes of one pitch and instrument with no gap over -difftime
+      struct decoded_note *op = oldndx < old.count ? &old.notes[oldndx] : NULL;
+      struct decoded_note *np = newndx < new.count ? &new.notes[newndx] : NULL;
+      struct decoded_note *first = !op ? np : !np ? op : compare_decoded_notes(op, np) <= 0 ? op : np;
+      unsigned long oldend = oldndx, newend = newndx;
+      uint32_t last_msec = first->start_msec;
+      while (true) { // take the earlier of the next old and new notes, while they are close enough
+         op = oldend < old.count ? &old.notes[oldend] : NULL;
+         np = newend < new.count ? &new.notes[newend] : NULL;
+         if (op && (op->note != first->note || op->instrument != first->instrument
+                    || op->start_msec > last_msec + diff_msec)) op = NULL;
+         if (np && (np->note != first->note || np->instrument != first->instrument
+                    || np->start_msec > last_msec + diff_msec)) np = NULL;
+         if (!op && !np) break;
+         if (op && (!np || op->start_msec <= np->start_msec)) {
+            last_msec = op->start_msec;
+            ++oldend; }
+         else {
+            last_msec = np->start_msec;
+            ++newend; } }
+      unsigned long nold = oldend - oldndx, nnew = newend - newndx;
+      if ((nold + 1) * (nnew + 1) <= DIFF_CLUSTER_MAX)
+         pair_cluster(&diffs, &old.notes[oldndx], nold, &new.notes[newndx], nnew, &same, &table, &table_room);
+      else pair_cluster_first_come(&diffs, &old.notes[oldndx], nold, &new.notes[newndx], nnew, &same);
+      oldndx = oldend;
+      newndx = newend; }
+   qsort(diffs.list, diffs.count, sizeof(struct difference), compare_differences);
+   printf("Comparing %s, with %lu notes, to %s, with %lu notes\n", oldname, old.count, newname, new.count);
+   for (unsigned long ndx = 0; ndx < diffs.count; ++ndx) print_difference(&diffs.list[ndx]);
+   printf("%lu notes are the same", same);
+   for (int kind = 0; kind < NUM_DIFF_KINDS; ++kind)
+      if (diffs.counts[kind]) printf(", %s: %lu", diff_kind_names[kind], diffs.counts[kind]);
+   printf("\n");
+   return diffs.count ? 1 : 0; }
+
+/* -merge combines several bytestreams into one, for example a melody and a separately
+   converted drum track, without going back to the MIDI files. Their timelines are
+   interleaved, and each generator of each input is given one of the output's generators
+   while it plays, so the combined score uses at most the -t budget (or 16 without -t).
+   If there isn't a free generator, a note from an earlier input replaces one still
+   playing from a later input, and otherwise it is dropped: the inputs are given in order
+   of priority. At each moment the stops of all the inputs are looked at before the plays, so
+   that generators freed at that time can be reused right away, and as in a conversion the
+   stop commands for the ones that weren't reused are output after the plays. A generator
+   keeps its number when it can, and consecutive delays are combined. The output has volumes,
+   instruments and percussion if any input does, and gets a header if any input has one
+   or -d was given. */
+
+struct merge_input {
+   struct bytestream bs;
+   bool done;
+   int out_tgen[16];            // the output generator each input generator is using now, or -1
+   int last_out_tgen[16];       // the one it used last, which it prefers to use again
+   byte instrument[16]; };
+
+struct merge_tgen {
+   bool playing;
+   bool stop_pending;           // it was stopped, but we haven't output the command yet
+   int input, tgnum;            // whose note it is playing
+   byte instrument; };          // the instrument it was last set to
+
+struct merge_status {
+   struct merge_input *inputs;
+   int num_inputs;
+   struct merge_tgen tgen[MAX_TONEGENS];
+   int budget, tgens_used;
+   bool volume, instruments;
+   unsigned long notes, dropped, replaced;
+   unsigned long time_msec; };  // the time of the output
+
+bool merge_at_command(struct bytestream *bs) { // is the next thing in it a note or instrument command?
+   return bs->ptr < bs->end && *bs->ptr >= 0x80
+          && (*bs->ptr & 0xf0) != CMD_STOP && (*bs->ptr & 0xf0) != CMD_RESTART; }
+
+void merge_stop(struct merge_status *ms, int input, int tgnum) {
+   struct merge_input *ip = &ms->inputs[input];
+   int out = ip->out_tgen[tgnum];
+   if (out < 0) return; // it isn't playing, or it was replaced or dropped
+   ms->tgen[out].playing = false;
+   ms->tgen[out].stop_pending = true; // unless another note is started on it now
+   ip->out_tgen[tgnum] = -1; }
+
+void merge_play(struct merge_status *ms, int input, int tgnum, int note, int volume) {
+   struct merge_input *ip = &ms->inputs[input];
+   int out = ip->out_tgen[tgnum];
+   if (out < 0) { // find it an output generator
+      int last = ip->last_out_tgen[tgnum];
+      if (last >= 0 && !ms->tgen[last].playing) out = last;
+      else if (tgnum < ms->budget && !ms->tgen[tgnum].playing) out = tgnum;
+      for (int ndx = 0; out < 0 && ndx < ms->budget; ++ndx)
+         if (!ms->tgen[ndx].playing) out = ndx;
+      if (out < 0) { // none are free: replace the note of the lowest-priority input, if it's lower than us
+         int victim = -1;
+         for (int ndx = 0; ndx < ms->budget; ++ndx)
+            if (ms->tgen[ndx].input > input && (victim < 0 || ms->tgen[ndx].input > ms->tgen[victim].input))
+               victim = ndx;
+         if (victim < 0) {
+            ++ms->dropped;
+            return; }
+         out = victim;
+         ms->inputs[ms->tgen[out].input].out_tgen[ms->tgen[out].tgnum] = -1;
+         ++ms->replaced; }
+      ip->out_tgen[tgnum] = ip->last_out_tgen[tgnum] = out;
+      ms->tgen[out].playing = true;
+      ms->tgen[out].stop_pending = false;
+      ms->tgen[out].input = input;
+      ms->tgen[out].tgnum = tgnum;
+      if (out + 1 > ms->tgens_used) ms->tgens_used = out + 1; }
+   if (ms->instruments && ms->tgen[out].instrument != ip->instrument[tgnum]) {
+      ms->tgen[out].instrument = ip->instrument[tgnum];
+      bin_instrument(out, ms->tgen[out].instrument); }
+   if (ms->volume) bin_play_volume(out, note, volume);
+   else bin_play(out, note, volume);
+   ++ms->notes; }
+
+int merge_bytestreams(const char *outname, int num_inputs, char *inputnames[]) { // returns 0 if successful
+   struct merge_status ms = { 0 };
+   struct bytestream_command command;
+   bool header = do_header;
+   byte f1 = 0;
+   if (num_inputs < 1) {
+      fprintf(stderr, "-merge needs the names of the bytestreams to merge\n");
+      return 1; }
+   ms.inputs = (struct merge_input *) arena_alloc(num_inputs * sizeof(struct merge_input));
+   if (!ms.inputs) {
+      fprintf(stderr, "Unable to allocate memory for %d bytestreams\n", num_inputs);
+      return 1; }
+   ms.num_inputs = num_inputs;
+   for (int input = 0; input < num_inputs; ++input) {
+      struct merge_input *ip = &ms.inputs[input];
+      if (!read_bytestream(&ip->bs, inputnames[input])) return 1;
+      ip->done = false;
+      for (int tgnum = 0; tgnum < 16; ++tgnum) {
+         ip->out_tgen[tgnum] = ip->last_out_tgen[tgnum] = -1;
+         ip->instrument[tgnum] = 0; }
+      header |= ip->bs.has_header;
+      f1 |= ip->bs.header.f1; }
+   ms.volume = f1 & HDR_F1_VOLUME_PRESENT;
+   ms.instruments = f1 & HDR_F1_INSTRUMENTS_PRESENT;
+   ms.budget = tonegens_given ? num_tonegens : MAX_TONEGENS;
+
+   outfile = fopen(outname, "wb");
+   if (!outfile) {
+      fprintf(stderr, "Unable to open output file %s\n", outname);
+      return 1; }
+   outfile_bytecount = 0;
+   if (header) { // the number of generators is filled in at the end
+      file_header.f1 = f1;
+      file_header.f2 = 0;
+      fwrite(&file_header, sizeof(file_header), 1, outfile);
+      outfile_bytecount += sizeof(file_header); }
+
+   while (true) {
+      // skip the delays of each input to the time of its next command, and find the earliest
+      unsigned long now = ULONG_MAX;
+      for (int input = 0; input < num_inputs; ++input) {
+         struct merge_input *ip = &ms.inputs[input];
+         while (!ip->done && !merge_at_command(&ip->bs))
+            if (!next_command(&ip->bs, &command) || command.cmd != BYTESTREAM_DELAY) ip->done = true;
+         if (ip->bs.bad) {
+            fclose(outfile);
+            outfile = NULL;
+            return 1; }
+         if (!ip->done && ip->bs.time_msec < now) now = ip->bs.time_msec; }
+      if (now == ULONG_MAX) break; // they have all ended
+      for (unsigned long delay = now - ms.time_msec; delay > 0; ) { // catch the output up
+         unsigned long msec = delay > 0x7fff ? 0x7fff : delay;
+         bin_delay(msec);
+         delay -= msec; }
+      ms.time_msec = now;
+      for (int pass = 0; pass < 2; ++pass) // first the stops, then everything else
+         for (int input = 0; input < num_inputs; ++input) {
+            struct merge_input *ip = &ms.inputs[input];
+            if (ip->done || ip->bs.time_msec != now) continue;
+            struct bytestream scan = ip->bs; // the stops are found without using up the commands
+            struct bytestream *bs = pass == 0 ? &scan : &ip->bs;
+            bool played[16] = { false }; // a stop after a play on the same generator stays after it
+            while (merge_at_command(bs) && next_command(bs, &command)) {
+               if (command.cmd == CMD_STOPNOTE && played[command.tgnum] == (pass == 1))
+                  merge_stop(&ms, input, command.tgnum);
+               else if (command.cmd == CMD_PLAYNOTE) {
+                  played[command.tgnum] = true;
+                  if (pass == 1) merge_play(&ms, input, command.tgnum, command.note, command.volume); }
+               else if (command.cmd == CMD_INSTRUMENT && pass == 1)
+                  ip->instrument[command.tgnum] = command.instrument; } }
+      for (int ndx = 0; ndx < ms.budget; ++ndx)
+         if (ms.tgen[ndx].stop_pending) {
+            bin_stop(ndx);
+            ms.tgen[ndx].stop_pending = false; } }
+
+   bin_end(gen_restart ? CMD_RESTART : CMD_STOP);
+   if (header) { // now we know how many generators are used
+      fseek(outfile, (char *) &file_header.num_tgens - (char *) &file_header, SEEK_SET);
+      putc(ms.tgens_used, outfile); }
+   bool ok = !ferror(outfile);
+   if (fclose(outfile) != 0) ok = false;
+   outfile = NULL;
+   if (!ok) {
+      fprintf(stderr, "Unable to write output file %s\n", outname);
+      return 1; }
+   printf("Merged %d bytestreams into %s: %ld bytes, %lu notes on %d tone generators\n",
+          num_inputs, outname, outfile_bytecount, ms.notes, ms.tgens_used);
+   if (ms.replaced || ms.dropped)
+      printf("  With a budget of %d tone generators, %lu notes of later inputs were cut off by earlier ones, and %lu notes were dropped\n",
+             ms.budget, ms.replaced, ms.dropped);
+   return 0; }
+
+/* -transform copies a bytestream while shifting its notes by -k chromatic notes and multiplying
+   its delays by the -timescale fraction p/q, so the key or speed can be changed without the MIDI
+   file. Translated percussion notes, 128 to 255, aren't shifted. The remainders of the scaled
+   delays are carried forward, as output_deficit_usec is in a conversion, so the timing doesn't
+   drift however long the score is. It reads and writes one command at a time. */
+
+int transform_bytestream(const char *outname, const char *inname) { // returns 0 if successful
+   FILE *in = fopen(inname, "rb");
+   if (!in) {
+      fprintf(stderr, "Unable to open bytestream file %s\n", inname);
+      return 1; }
+   outfile = fopen(outname, "wb");
+   if (!outfile) {
+      fprintf(stderr, "Unable to open output file %s\n", outname);
+      fclose(in);
+      return 1; }
+   outfile_bytecount = 0;
+   bool volume = volume_output;
+   int c1 = getc(in), c2 = getc(in);
+   if (c1 == 'P' && c2 == 't') { // copy the header, with any parts of it we don't know about
+      int length = getc(in), f1 = getc(in);
+      volume = f1 != EOF && (f1 & HDR_F1_VOLUME_PRESENT);
+      putc('P', outfile);
+      putc('t', outfile);
+      putc(length, outfile);
+      putc(f1, outfile);
+      for (int ndx = 4; ndx < length; ++ndx) putc(getc(in), outfile);
+      outfile_bytecount += length;
+      c1 = getc(in);
+      c2 = getc(in); }
+   else if (do_header) { // add one
+      file_header.f1 = (volume_output ? HDR_F1_VOLUME_PRESENT : 0) | (instrumentoutput ? HDR_F1_INSTRUMENTS_PRESENT : 0)
+                       | (percussion_translate ? HDR_F1_PERCUSSION_PRESENT : 0);
+      fwrite(&file_header, sizeof(file_header), 1, outfile);
+      outfile_bytecount += sizeof(file_header); }
+
+   unsigned long carry = 0, in_msec = 0, out_msec = 0, notes = 0;
+   bool ended = false, cutoff = false;
+   for (int cmd = c1, next = c2; cmd != EOF && !ended; cmd = next, next = getc(in)) {
+      if (cmd < 0x80) { // a delay: scale it, keeping the remainder for the next one
+         if (next == EOF) {
+            cutoff = true;
+            break; }
+         unsigned long delay = ((unsigned long)cmd << 8) | next;
+         unsigned long scaled = delay * timescale_num + carry;
+         in_msec += delay;
+         carry = scaled % timescale_den;
+         for (scaled /= timescale_den; scaled > 0; ) {
+            unsigned long msec = scaled > 0x7fff ? 0x7fff : scaled;
+            bin_delay(msec);
+            scaled -= msec;
+            out_msec += msec; }
+         next = getc(in);
+         continue; }
+      switch (cmd & 0xf0) {
+      case CMD_PLAYNOTE: {
+         int note = next, volume_byte = volume ? getc(in) : 0;
+         if (note == EOF || volume_byte == EOF) {
+            cutoff = true;
+            break; }
+         if (note < 128) { // a percussion note is left alone
+            note += keyshift;
+            if (note < 0) note = 0;
+            if (note > 127) note = 127; }
+         if (volume) bin_play_volume(cmd & 0x0f, note, volume_byte);
+         else bin_play(cmd & 0x0f, note, 0);
+         ++notes;
+         next = getc(in);
+         break; }
+      case CMD_INSTRUMENT:
+         if (next == EOF) {
+            cutoff = true;
+            break; }
+         bin_instrument(cmd & 0x0f, next);
+         next = getc(in);
+         break;
+      case CMD_STOPNOTE:
+         bin_stop(cmd & 0x0f);
+         break;
+      case CMD_STOP:
+      case CMD_RESTART:
+         bin_end(cmd);
+         ended = true;
+         break;
+      default:
+         fprintf(stderr, "%s: unknown command %02X\n", inname, cmd);
+         cutoff = true; }
+      if (cutoff) break; }
+   fclose(in);
+   if (cutoff) fprintf(stderr, "%s: the bytestream ends in the middle of a command\n", inname);
+   bool ok = !ferror(outfile);
+   if (fclose(outfile) != 0) ok = false;
+   outfile = NULL;
+   if (!ok) {
+      fprintf(stderr, "Unable to write output file %s\n", outname);
+      return 1; }
+   printf("Transformed %s into %s: %ld bytes, %lu notes shifted by %d, %lu.%03lu seconds now %lu.%03lu seconds\n",
+          inname, outname, outfile_bytecount, notes, keyshift,
+          in_msec / 1000, in_msec % 1000, out_msec / 1000, out_msec % 1000);
+   return cutoff ? 1 : 0; }
+
+int main (int argc, char *argv[]) {
+   int argno;
+
+   printf ("MIDITONES V%s, (C) 2011-2021 Len Shustek\n", VERSION);
+   if (argc == 1) {     // no arguments
+      SayUsage (argv[0]);
+      return 1; }
+
+   argno = HandleOptions (argc, argv); // process options
+   check_option(percussion_tonegens < num_tonegens, "-percussiongens must leave some tone generators for other notes");
+   check_option(consolidate_usec || !(octave_fold || any_instrument), "-octavefold and -anyinstrument only work with -consolidate");
+   check_option(!mergereports_name || !manifest_name, "-mergereports and -manifest can't be used together");
+   check_option(num_shards == 1 || manifest_name, "-shard only works with -manifest");
+   check_option(num_jobs == 1 || manifest_name || tar_name, "-jobs only works with -manifest or -tar");
+   check_option(!manifest_name || !tar_name, "-manifest and -tar can't be used together");
+   check_option((!outdir_name && !outtar_name) || tar_name, "-outdir and -outtar only work with -tar");
+#ifdef _WIN32
+   check_option(num_jobs == 1, "-jobs isn't available on Windows");
+   check_option(!pipeline, "-pipeline isn't available on Windows");
+#endif
+   scanning = scan_only || estimate_only;
+   check_option(!(scanning && parseonly), "-scan and -estimate can't be used with -p");
+   check_option(!(export_events && (scanning || parseonly)), "-events can't be used with -scan, -estimate or -p");
+   check_option(!(make_map && (scanning || parseonly)), "-map can't be used with -scan, -estimate or -p");
+   check_option(transform_name || (timescale_num == 1 && timescale_den == 1), "-timescale only works with -transform");
+   choose_output();
+   if (readevents_name)
+      return read_events(readevents_name);
+   if (diff_name) {
+      check_option(argno != 0, "-diff needs the name of the new bytestream file");
+      return diff_bytestreams(diff_name, argv[argno]); }
+   if (merge_name)
+      return merge_bytestreams(merge_name, argno ? argc - argno : 0, argv + argno);
+   if (transform_name) {
+      check_option(argno != 0, "-transform needs the name of the bytestream to transform");
+      return transform_bytestream(transform_name, argv[argno]); }
+   if (mergereports_name)
+      return merge_reports(argno ? argc - argno : 0, argv + argno);
+   if (manifest_name)
+      return convert_manifest(argc, argv) ? 1 : 0;
+   if (tar_name)
+      return convert_archive(argc, argv) ? 1 : 0;
+   if (argno == 0) {
+      fprintf (stderr, "\n*** No basefilename given\n\n");
+      SayUsage (argv[0]);
+      exit (4); }
+   return convert_file(argv[argno], argc, argv); }
+
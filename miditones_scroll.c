@@ -45,6 +45,11 @@
 *
 *    -n   Don't show the bytestream data. (Ignored if -c is specified.)
 *
+*    -m   Read the source map <basefilename>.map that MIDITONES wrote with its -map
+*         option, and after each line show where its commands came from: the MIDI
+*         track, tick, channel and note, and whether it is a play, the sustain phase
+*         of a note, a stop, or an instrument change.
+*
 *  For source code to this and related programs, see
 *    www.github.com/LenShustek/miditones
 *    www.github.com/LenShustek/arduino-playtune
@@ -118,9 +123,11 @@
 * 5 May 2021, L. Shustek, V1.10
 *     - add -n option to not print the bytestream data
 *     - don't show instrument summary if instrument data wasn't in the bytestream
+* 18 October 2026, V1.11
+*     - add -m option to annotate the commands with their MIDI source from a .map file
 */
 
-#define VERSION "1.10"
+#define VERSION "1.11"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -161,6 +168,9 @@ bool ignore_volume = false;
 bool showhex = false;
 bool showbytestream = true;
 bool got_instruments = false;
+bool use_map = false;
+unsigned char *mapdata = NULL;  // the source map file
+int *map_record = NULL;         // for each bytestream offset, the number of its map record, or -1
 unsigned max_vol = 0, min_vol = 255;
 
 struct file_hdr_t {             /* what the optional file header looks like */
@@ -244,6 +254,7 @@ void SayUsage (char *programName) {
       " -c  creates an annotated C source file as <basefile>.c",
       " -x  show notes in hex instead of octave/note",
       " -n  don't show the bytestream data",
+      " -m  show the MIDI source of each command from <basefile>.map",
       "" };
    int i = 0;
    while (usage[i][0] != '\0')
@@ -272,6 +283,9 @@ int HandleOptions (int argc, char *argv[]) {
          case 'N':
             showbytestream = false;
             break;
+         case 'M':
+            use_map = true;
+            break;
          case 'T':
             if (sscanf (&argv[i][2], "%d", &num_tonegens) != 1 || num_tonegens < 1
                   || num_tonegens > MAX_TONEGENS)
@@ -357,11 +371,68 @@ void file_error (char *msg, unsigned char *bufptr) {
       fprintf (outfile, ptr == bufptr ? " [%02X]  " : "%02X ", *ptr);
    fprintf (outfile, "\n"); }
 
+/**************  Read the source map  **************/
+
+/* The .map file that MIDITONES writes with -map has a 12-byte header ("MTmp", a 2-byte version,
+   a 2-byte record size, and a 4-byte record count) and then a 14-byte record for each command:
+   the 4-byte bytestream offset, 4-byte MIDI tick, 2-byte track, 2-byte channel, 1-byte note,
+   and 1-byte reason. All numbers are little-endian. We index the records by offset, so finding
+   the source of a command takes one lookup. */
+
+#define MAP_HEADER_SIZE 12
+#define MAP_RECORD_SIZE 14
+static char *map_reasons[] = { "play", "sustain", "stop", "instrument" };
+
+unsigned long little_endian (unsigned char *ptr, int bytes) {
+   unsigned long val = 0;
+   for (int i = bytes - 1; i >= 0; --i) val = (val << 8) | ptr[i];
+   return val; }
+
+bool read_map (char *filename) {
+   FILE *mapfile = fopen (filename, "rb");
+   if (!mapfile) {
+      fprintf (stderr, "Unable to open source map file %s\n", filename);
+      return false; }
+   fseek (mapfile, 0, SEEK_END);
+   long maplen = ftell (mapfile);
+   fseek (mapfile, 0, SEEK_SET);
+   mapdata = (unsigned char *) malloc (maplen + 1);
+   map_record = (int *) malloc ((buflen + 1) * sizeof (int));
+   if (!mapdata || !map_record || fread (mapdata, 1, maplen, mapfile) != maplen) {
+      fprintf (stderr, "Unable to read source map file %s\n", filename);
+      return false; }
+   fclose (mapfile);
+   unsigned long count = maplen >= MAP_HEADER_SIZE ? little_endian (mapdata + 8, 4) : 0;
+   if (maplen < MAP_HEADER_SIZE || mapdata[0] != 'M' || mapdata[1] != 'T' || mapdata[2] != 'm' || mapdata[3] != 'p'
+         || little_endian (mapdata + 4, 2) != 1 || little_endian (mapdata + 6, 2) != MAP_RECORD_SIZE
+         || maplen != MAP_HEADER_SIZE + count * MAP_RECORD_SIZE) {
+      fprintf (stderr, "%s is not a version 1 source map file\n", filename);
+      return false; }
+   for (unsigned long offset = 0; offset <= buflen; ++offset) map_record[offset] = -1;
+   for (unsigned long i = 0; i < count; ++i) {
+      unsigned long offset = little_endian (mapdata + MAP_HEADER_SIZE + i * MAP_RECORD_SIZE, 4);
+      if (offset < buflen) map_record[offset] = i; }
+   printf ("Read %lu source map records from %s\n", count, filename);
+   return true; }
+
+// show where the commands in these bytes came from
+void print_sources (unsigned char *from, unsigned char *to) {
+   for (; from <= to; ++from) {
+      int record = map_record[from - buffer];
+      if (record >= 0) {
+         unsigned char *rp = mapdata + MAP_HEADER_SIZE + record * MAP_RECORD_SIZE;
+         unsigned reason = rp[13];
+         fprintf (outfile, "%s%15s%04X: %-10s track %lu tick %lu channel %lu note %u\n",
+                  codeoutput ? "//" : "", "", (unsigned int) (from - buffer),
+                  reason < 4 ? map_reasons[reason] : "?", little_endian (rp + 8, 2),
+                  little_endian (rp + 4, 4), little_endian (rp + 10, 2), rp[12]); } } }
+
 /**************  Output a line for the current status as we start a delay  **************/
 
 // show the current time, status of all the tone generators, and the bytestream data that got us here
 
 void print_status (void) {
+   unsigned char *firstbyte = lastbufptr;
    unsigned gen;
    bool any_instr_changed = false;
    for (gen = 0; gen < num_tonegens; ++gen)
@@ -403,6 +474,7 @@ void print_status (void) {
    if (showbytestream) for (; lastbufptr <= bufptr; ++lastbufptr)
          fprintf (outfile, codeoutput ? "0x%02X," : "%02X ", *lastbufptr);
    fprintf (outfile, "\n");
+   if (use_map) print_sources (firstbyte, bufptr);
    lastbufptr = bufptr + 1; }
 
 int countbits (unsigned int bitmap) {
@@ -457,6 +529,10 @@ int main (int argc, char *argv[]) {
       return 8; }
    fread (buffer, buflen, 1, infile);
    fclose (infile);
+   if (use_map) {
+      strlcpy (filename, filebasename, MAXPATH);
+      strlcat (filename, ".map", MAXPATH);
+      if (!read_map (filename)) return 8; }
 
    /* write the prologue */
 